@@ -0,0 +1,63 @@
+#!/usr/bin/env bash
+set -euo pipefail
+
+# Benchmark for blockminmax update engines
+# - Generates a synthetic point cloud (random or scan-ordered) with awk
+# - Times the dense engine at several prefetch distances and the sort engine
+# - Checks that every run produced the same output as the first
+#
+# Usage: bench_blockminmax.sh [points] [width] [random|scan]
+#   points  number of points (default 2000000)
+#   width   side of the square region in cells at -I1 (default 4000)
+
+SCRIPT_DIR="$(cd "$(dirname "$0")" && pwd)"
+cd "$SCRIPT_DIR"
+
+BIN=./blockminmax
+if [[ ! -x "$BIN" ]]; then
+  echo "Building blockminmax ..." >&2
+  make >/dev/null
+fi
+
+NPTS=${1:-2000000}
+WIDTH=${2:-4000}
+ORDER=${3:-random}
+INP=bench_${ORDER}_${NPTS}.xyz
+REG="-R0/${WIDTH}/0/${WIDTH}"
+
+if [[ ! -f "$INP" ]]; then
+  echo "Generating $NPTS $ORDER points over ${WIDTH}x${WIDTH} cells -> $INP" >&2
+  awk -v n="$NPTS" -v w="$WIDTH" -v order="$ORDER" 'BEGIN {
+    srand(1);
+    rows = int(n / w); if (rows < 1) rows = 1;
+    for (i = 0; i < n; ++i) {
+      if (order == "scan") { x = (i % w) + rand() * 0.5; y = int(i / w) * w / rows; }
+      else { x = rand() * w; y = rand() * w; }
+      printf "%.3f %.3f %.2f\n", x, y, rand() * 100;
+    }
+  }' > "$INP"
+fi
+
+TIMEFORMAT=%R
+run() {
+  local label=$1; shift
+  local secs
+  secs=$( { time "$BIN" $REG -I1 -PATH "$INP" -o bench_out.min "$@" >/dev/null 2>&1; } 2>&1 )
+  if [[ -f bench_ref.min ]]; then
+    cmp -s bench_ref.min bench_out.min || { echo "FAIL $label: output differs"; exit 1; }
+  else
+    mv bench_out.min bench_ref.min
+  fi
+  printf "%-24s %8ss\n" "$label" "$secs"
+}
+
+rm -f bench_ref.min
+echo "blockminmax benchmark: $NPTS $ORDER points, ${WIDTH}x${WIDTH} grid"
+for d in 0 4 8 16 32 64; do
+  run "dense prefetch=$d" --engine dense --prefetch "$d"
+done
+run "dense prefetch=16 no-runs" --engine dense --prefetch 16 --no-runs
+run "dense prefetch=16 no-simd" --engine dense --prefetch 16 --no-simd
+run "sort" --engine sort
+run "auto" --engine auto
+rm -f bench_ref.min bench_out.min
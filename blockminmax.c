@@ -6,7 +6,9 @@
  * Functionality:
  *   - Reads a large XYZ point cloud (x y z per line)
  *   - Bins points onto a regular grid defined by -R and -I
- *   - For each cell, computes either the minimum (-default) or maximum (-MAX) z
+ *   - For each cell, reduces the z values of its points: minimum (default),
+ *     maximum (-MAX) or another --reducer (first, last, sum, nearest, mode)
+ *   - Optionally filters points on ingest by z range, inner box or polygon mask
  *   - Writes out triplets "x y z" for cells that received at least one point
  *
  * Differences vs the Tcl script:
@@ -17,8 +19,10 @@
  *     nearest grid cell (clamping indices to [0..N-1])
  *   - Provides clearer errors and a proper usage message
  *
- * Build:
- *   gcc -O3 -march=native -flto -DNDEBUG -o blockminmax other/blockminmax.c
+ * Build (what `make` runs; portable, the hot kernels are target_clones for
+ * x86-64-v2/v3/v4 picked at startup, so no -march=native):
+ *   gcc -O3 -DNDEBUG -ffp-contract=off -flto -o blockminmax blockminmax.c \
+ *       -lm -lrt -pthread
  *
  * Example:
  *   ./blockminmax -R1585520.5/1587224.5/5464422.5/5467728.5 -I0.5 \
@@ -27,12 +31,38 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+/* Hot loops (parsing and binning, reduction, formatting) are compiled for
+   several x86-64 ISA levels and the one matching the running CPU is chosen
+   when the program loads (function multiversioning through ifunc), so one
+   portable binary runs at full speed on every node. */
+#if defined(HAVE_X86_SIMD) && defined(__linux__) && !defined(__clang__)
+#define HOT_KERNEL __attribute__((target_clones("default", "arch=x86-64-v2", \
+                                                "arch=x86-64-v3", "arch=x86-64-v4")))
+#else
+#define HOT_KERNEL
+#endif
+
+#define STR_(x) #x
+#define STR(x) STR_(x)
 
 #ifndef NDEBUG
 #define DEBUG_PRINT(...) do { fprintf(stderr, __VA_ARGS__); } while (0)
@@ -40,15 +70,124 @@
 #define DEBUG_PRINT(...) do { } while (0)
 #endif
 
+/* Update engines. ENGINE_DEFAULT picks dense or sort from the grid size;
+   ENGINE_AUTO is resolved from a profile of the first input chunk. */
+typedef enum {
+    ENGINE_DEFAULT,
+    ENGINE_AUTO,
+    ENGINE_DENSE,        /* update grid[idx] in place, one point at a time */
+    ENGINE_SORT          /* buffer records, partition by cell range, reduce per bucket */
+} EngineKind;
+
+/* Per-cell reducers, listed once as X(ENUM, name). The enum, the option names
+   and the per-reducer kernels (bin_span_<name>() and friends) are generated
+   from this list; see red_takes() for the policy each one applies. */
+#define REDUCERS(X) \
+    X(MIN, min)         /* smallest z; ties keep the first point */ \
+    X(MAX, max)         /* largest z; ties keep the first point */ \
+    X(FIRST, first)     /* first point in input order */ \
+    X(LAST, last)       /* last point in input order */ \
+    X(SUM, sum)         /* sum of z, added in input order */ \
+    X(NEAREST, nearest) /* point closest to the cell node; ties keep the first */ \
+    X(MODE, mode)       /* most frequent z; ties go to the smallest value */
+
+typedef enum {
+#define X(N, n) RED_##N,
+    REDUCERS(X)
+#undef X
+} ReducerKind;
+
+static const char *const reducer_names[] = {
+#define X(N, n) #n,
+    REDUCERS(X)
+#undef X
+};
+
+/* Post-pass morphological filters (--morph) over square windows. */
+typedef enum {
+    MORPH_ERODE,         /* windowed minimum */
+    MORPH_DILATE,        /* windowed maximum */
+    MORPH_OPEN,          /* erode, then dilate */
+    MORPH_CLOSE          /* dilate, then erode */
+} MorphKind;
+
+static const char *const morph_names[] = { "erode", "dilate", "open", "close" };
+
+#define MORPH_MAX 8      /* most --morph steps */
+
+typedef struct {
+    MorphKind op;
+    unsigned w;          /* window width in cells, odd */
+} MorphStep;
+
+/* Gap filling of empty cells (--fill). */
+typedef enum {
+    FILL_NONE,
+    FILL_NN,             /* value of the nearest occupied cell */
+    FILL_IDW             /* inverse-distance mean within a radius */
+} FillKind;
+
+/* Dense engine batch size; see batch_apply(). */
+#define BATCH_RECS       256
+#define PREFETCH_DEFAULT 16
+
+/* --groupby: most ranges, and most distinct values, one run may route to. */
+#define GROUP_MAX 256
+/* --zcols: most value columns. */
+#define BAND_MAX  16
+
 typedef struct {
     double xmin, xmax, ymin, ymax;
     double inc;          /* grid increment */
-    bool find_min;       /* true: compute min; false: compute max */
+    double inv_inc;      /* 1/inc when inc is an exact power of two, else 0 */
+    ReducerKind reducer; /* per-cell statistic (--reducer, -MAX) */
     char *path;          /* input path */
     char *out;           /* optional output path (if NULL, path + .min/.max) */
     bool tcl_round;      /* emulate Tcl rounding for cell snapping */
     bool tcl_fmt;        /* format output like Tcl script (x,y %.1f and z token as text) */
     bool gmt_bin;        /* emulate GMT block assignment: floor-based, skip outside region */
+    bool region_auto;    /* -Rauto: derive the region from the data */
+    bool region_snap;    /* -Rauto+s: snap the derived region outward to multiples of -I */
+    int threads;         /* worker threads for parallel stages (--threads) */
+    unsigned preview;    /* --preview N: bin one input chunk in every N (0: off) */
+    bool preview_random; /* --preview N+r: random offset within each stratum */
+    bool read_once;      /* --read-once: drop the input's page cache behind the reader */
+    char *snapshot;      /* --snapshot: file rewritten with the partial grid during ingest */
+    double snapshot_every; /* seconds between snapshots */
+    char *shm;           /* --shm: POSIX shared-memory object holding the final grid */
+    char *grid_file;     /* --grid-file: values and hit bytes in this mapped file */
+    EngineKind engine;   /* update engine (--engine) */
+    double sort_above;   /* default engine is sort for grids of at least this many bytes */
+    bool no_runs;        /* --no-runs: disable the same-cell run fast path */
+    int prefetch;        /* dense engine prefetch distance; -1: from grid size */
+    bool no_simd;        /* --no-simd: keep to the scalar update kernels */
+    bool stats;          /* print run statistics to stderr (--stats) */
+    bool zfilter;        /* -Z: keep zmin <= z <= zmax */
+    double zmin, zmax;
+    bool clip;           /* --clip: keep points inside this box */
+    double cxmin, cxmax, cymin, cymax;
+    char *mask;          /* --mask: polygon file (GMT multi-segment or GeoJSON) */
+    int group_col;       /* --groupby: 1-based input column, 0 when off */
+    size_t ngroup;       /* --groupby ranges; 0: one group per distinct value */
+    double *group_lo, *group_hi;
+    char **group_name;   /* range names; NULL entries are named after the range */
+    char *diff;          /* --diff: second input; the output is its grid minus this one's */
+    bool ground;         /* --ground: keep only bare-earth cells (progressive opening) */
+    double ground_slope, ground_window;
+    MorphStep morph[MORPH_MAX]; /* --morph: filters applied to every grid after binning */
+    size_t nmorph;
+    FillKind fill;       /* --fill: fill empty cells before output */
+    double fill_radius;  /* --fill idw:R search radius */
+    unsigned qt_split;   /* --quadtree: blocks holding more points split (0: off) */
+    unsigned qt_levels;  /* coarsest block is 2^levels cells across */
+    char *seed;          /* --seed: previous output loaded into the grid first */
+    bool delta;          /* --delta: write only cells (tiles) this run changed */
+    char *tiles;         /* --tiles: directory of z/x/y tiles */
+    unsigned tile_size;  /* cells across a tile (--tile-size) */
+    unsigned tile_levels; /* pyramid levels, each half the resolution of the next */
+    bool tile_f32;       /* --tile-format f32: raw float32 rasters (else text rows) */
+    size_t nband;        /* value columns reduced per point (--zcols; default 1) */
+    int zcol[BAND_MAX];  /* their 1-based input columns (default 3) */
 } Options;
 
 static void die(const char *msg) {
@@ -63,17 +202,112 @@ static void die_perror(const char *msg) {
 
 static void usage(FILE *out) {
     fprintf(out,
-        "Usage: blockminmax -Rxmin/xmax/ymin/ymax [-Iinc] -PATH <file> [-MAX] [-o <outfile>] [--tclround] [--tclfmt] [--gmtbin]\n"
+        "Usage: blockminmax -Rxmin/xmax/ymin/ymax|-Rauto[+s] [-Iinc] -PATH <file> [-MAX] [-o <outfile>] [--tclround] [--tclfmt] [--gmtbin]\n"
+        "                   [--reducer min|max|first|last|sum|nearest|mode]\n"
+        "                   [--engine dense|sort|auto] [--sort-above MiB] [--no-runs] [--prefetch D]\n"
+        "                   [--no-simd]\n"
+        "                   [--stats] [--threads N] [--preview N[+r]] [--read-once]\n"
+        "                   [--snapshot <file> [--snapshot-every SEC]] [--shm <name>] [--grid-file <file>]\n"
+        "                   [-Z zmin/zmax] [--clip xmin/xmax/ymin/ymax] [--mask <file>]\n"
+        "                   [--groupby col[:[name=]lo[/hi],...]] [--zcols c1,c2,...]\n"
+        "                   [--diff <file2>] [--ground slope/window] [--morph op:W[,op:W...]]\n"
+        "                   [--fill nn|idw:R] [--quadtree N[:levels]]\n"
+        "                   [--tiles <dir> [--tile-size N] [--tile-levels L] [--tile-format text|f32]]\n"
+        "                   [--seed <file>] [--delta]\n"
         "\n"
         "Options:\n"
         "  -Rxmin/xmax/ymin/ymax  Region bounds (inclusive).\n"
+        "  -Rauto[+s]             Derive the region from the x/y extent of the input with a\n"
+        "                         parallel pre-scan; +s snaps it outward to multiples of -I.\n"
         "  -Iinc                  Grid increment (default: 1).\n"
         "  -PATH <file>           Input XYZ file. (alias: -path)\n"
-        "  -MAX                   Compute maxima instead of minima.\n"
-        "  -o <outfile>           Output file (default: <file>.min or <file>.max).\n"
+        "  -MAX                   Compute maxima instead of minima (same as --reducer max).\n"
+        "  --reducer NAME         Per-cell statistic: min (default), max, first or last point\n"
+        "                         in input order, sum, nearest (point closest to the cell\n"
+        "                         node) or mode (most frequent z, ties to the smallest).\n"
+        "  -o <outfile>           Output file (default: <file>.<reducer>, e.g. <file>.min).\n"
         "  --tclround             Snap to grid like Tcl's findClosestValue (ties go lower).\n"
         "  --tclfmt               Format like Tcl script: x,y as %%.1f; z as original token.\n"
         "  --gmtbin               Assign bins like GMT blockmedian: floor((x-xmin)/inc), drop outside -R.\n"
+        "  --engine NAME          Update engine: dense (in-place updates), sort (buffer and\n"
+        "                         partition points by cell range, then reduce bucket by\n"
+        "                         bucket) or auto, which profiles the first input chunk.\n"
+        "                         Default: dense, or sort for grids above --sort-above.\n"
+        "  --sort-above MiB       Grid size from which the default engine is sort (default: 512).\n"
+        "  --no-runs              Disable the same-cell run fast path (consecutive points in\n"
+        "                         one cell are normally reduced before the engine sees them).\n"
+        "  --prefetch D           Dense engine: apply updates in batches, prefetching grid,\n"
+        "                         hit and token slots D points ahead (0: unbatched). Default:\n"
+        "                         16 for grids larger than cache, otherwise 0.\n"
+        "  --no-simd              Use scalar update kernels even where AVX-512 is available.\n"
+        "  --stats                Print point counts, occupancy and engine choice to stderr.\n"
+        "  --threads N            Worker threads for parallel stages (default: online CPUs).\n"
+        "  --preview N[+r]        Quick look: bin only one 4 MiB chunk in every N (+r: at a\n"
+        "                         random newline-aligned offset in each stratum). The output\n"
+        "                         starts with a '# approximate' comment line.\n"
+        "  --read-once            Read the input with sequential readahead and drop its\n"
+        "                         pages from the page cache once consumed, so a large\n"
+        "                         ingest does not evict other jobs' cached data.\n"
+    );
+    fprintf(out,
+        "  --snapshot <file>      Periodically replace <file> with the grid binned so far\n"
+        "                         (written by a forked copy; atomic rename).\n"
+        "  --snapshot-every SEC   Interval between snapshots (default: 5).\n"
+        "  --shm <name>           Bin directly into POSIX shared memory object <name>\n"
+        "                         (header + float64 grid, NaN for empty cells). No text\n"
+        "                         output is written unless -o is also given.\n"
+        "  --grid-file <file>     Keep the grid (values, hit bytes) in a sparse file\n"
+        "                         mapped shared instead of in memory, with the --shm\n"
+        "                         header. It may exceed RAM and is kept after the run.\n"
+        "                         No text output is written unless -o is also given.\n"
+        "  -Z zmin/zmax           Keep only points with zmin <= z <= zmax (either bound may\n"
+        "                         be left empty).\n"
+        "  --clip xmin/xmax/ymin/ymax\n"
+        "                         Keep only points inside this box (tested before binning).\n"
+        "  --mask <file>          Keep only points whose cell node lies inside the polygons in\n"
+        "                         <file>: GMT multi-segment ('>' between polygons) or GeoJSON\n"
+        "                         (Polygon/MultiPolygon). Rasterized once to a cell bitmap.\n"
+        "  --groupby col[:ranges] Route each point by the value in input column col (4 or\n"
+        "                         more; 1-3 are x y z) into its own grid, written to\n"
+        "                         <outfile>.<group>. Without ranges every distinct value is\n"
+        "                         a group; with a comma-separated list of [name=]lo[/hi]\n"
+        "                         each range is (the first match wins, others are filtered).\n"
+        "                         Grids are allocated when their group first occurs.\n"
+        "  --zcols c1,c2,...      Reduce several input columns (3 or more; 3 is z) with the\n"
+        "                         same reducer, one grid each, written as extra output\n"
+        "                         columns in this order. -Z applies to the first.\n"
+    );
+    fprintf(out,
+        "  --diff <file2>         Bin <file2> as well (in parallel, same grid and reducer)\n"
+        "                         and write its grid minus the -PATH grid, for cells both\n"
+        "                         occupy (default output: <file>.<reducer>.diff). Prints\n"
+        "                         statistics of the difference.\n"
+        "  --ground slope/window  After binning, keep only bare-earth cells: progressive\n"
+        "                         openings up to the window (map units) empty each cell\n"
+        "                         that rises more than slope times the window radius\n"
+        "                         above the opened surface. Meant for the min grid.\n"
+        "  --morph op:W[,...]     After binning, filter each grid with op (erode, dilate,\n"
+        "                         open or close) over W x W cells (W odd), in the order\n"
+        "                         given. Empty cells neither contribute nor get filled.\n"
+        "                         Filtered z is written numerically.\n"
+        "  --fill nn|idw:R        Before output, fill empty cells with the value of the\n"
+        "                         nearest occupied cell (nn), or the inverse-distance\n"
+        "                         mean of those within R map units (idw). Adds a last\n"
+        "                         column: 1 for a filled cell, 0 otherwise.\n"
+        "  --quadtree N[:levels]  Adaptive blocks instead of a grid: blocks from 2^levels\n"
+        "                         cells (default 3) down to one -I cell, split while they\n"
+        "                         hold more than N points. Writes xc yc z width height\n"
+        "                         per block (blocks on the -R edge are clipped to it).\n"
+        "  --tiles <dir>          Also (without -o: only) write the grid as <dir>/z/x/y.txt\n"
+        "                         tiles of --tile-size cells (256), y from the north, plus\n"
+        "                         <dir>/index.json. Empty tiles are not written.\n"
+        "  --tile-levels L        Pyramid levels (1); each coarser level merges 2x2 cells.\n"
+        "  --tile-format f32      Tiles as raw float32 rasters in native byte order\n"
+        "                         (<y>.f32, NaN for empty cells) instead of text rows.\n"
+        "  --seed <file>          Start from a previous output (x y z rows, same -R and -I)\n"
+        "                         and merge the input into it.\n"
+        "  --delta                Write only the cells a point changed in this run; with\n"
+        "                         --tiles, only the tiles holding such a cell (in full).\n"
         "  -h, --help             Show this help.\n"
         "\n"
         "Notes:\n"
@@ -128,6 +362,159 @@ static bool parse_double_arg(const char *flag, const char *next, double *out) {
     *out = v; return true;
 }
 
+/* Parse "lo/hi" for -Z; an empty bound is open. */
+static bool parse_zrange(const char *s, double *lo, double *hi) {
+    const char *slash = s ? strchr(s, '/') : NULL;
+    if (!slash || strchr(slash + 1, '/')) return false;
+    char *end = NULL;
+    *lo = -INFINITY;
+    *hi = INFINITY;
+    if (slash != s) {
+        errno = 0; *lo = strtod(s, &end);
+        if (errno || end != slash) return false;
+    }
+    if (slash[1]) {
+        errno = 0; *hi = strtod(slash + 1, &end);
+        if (errno || end == slash + 1 || *end) return false;
+    }
+    return *lo <= *hi;
+}
+
+/* Parse "col[:[name=]lo[/hi],...]" for --groupby. */
+static bool parse_groupby(const char *s, Options *opt) {
+    char *end = NULL;
+    errno = 0;
+    long col = strtol(s, &end, 10);
+    if (errno || end == s || col < 4 || col > 1000) return false;
+    opt->group_col = (int)col;
+    if (!*end) return true;
+    if (*end != ':' || !end[1]) return false;
+    for (const char *p = end + 1; ; ) {
+        if (opt->ngroup == GROUP_MAX) return false;
+        const char *comma = strchr(p, ',');
+        const size_t len = comma ? (size_t)(comma - p) : strlen(p);
+        const char *eq = memchr(p, '=', len);
+        const size_t k = opt->ngroup++;
+        opt->group_lo = (double*)realloc(opt->group_lo, opt->ngroup * sizeof(double));
+        opt->group_hi = (double*)realloc(opt->group_hi, opt->ngroup * sizeof(double));
+        opt->group_name = (char**)realloc(opt->group_name, opt->ngroup * sizeof(char*));
+        if (!opt->group_lo || !opt->group_hi || !opt->group_name) die("Out of memory");
+        opt->group_name[k] = NULL;
+        if (eq) {
+            if (eq == p || strcspn(p, "/") < (size_t)(eq - p)) return false;
+            opt->group_name[k] = (char*)malloc((size_t)(eq - p) + 1);
+            if (!opt->group_name[k]) die("Out of memory");
+            memcpy(opt->group_name[k], p, (size_t)(eq - p));
+            opt->group_name[k][eq - p] = '\0';
+            p = eq + 1;
+        }
+        errno = 0; opt->group_lo[k] = strtod(p, &end);
+        if (errno || end == p) return false;
+        opt->group_hi[k] = opt->group_lo[k];
+        if (*end == '/') {
+            p = end + 1;
+            errno = 0; opt->group_hi[k] = strtod(p, &end);
+            if (errno || end == p) return false;
+        }
+        if (*end != (comma ? ',' : '\0') || !(opt->group_lo[k] <= opt->group_hi[k])) return false;
+        if (!comma) return true;
+        p = comma + 1;
+    }
+}
+
+/* Parse "op:W[,op:W...]" for --morph. */
+static bool parse_morph(const char *s, Options *opt) {
+    opt->nmorph = 0;
+    for (const char *p = s; ; ) {
+        const char *colon = strchr(p, ':');
+        if (!colon || opt->nmorph == MORPH_MAX) return false;
+        size_t k = 0;
+        while (k < sizeof(morph_names) / sizeof(morph_names[0]) &&
+               (strlen(morph_names[k]) != (size_t)(colon - p) || strncmp(p, morph_names[k], (size_t)(colon - p)))) ++k;
+        if (k == sizeof(morph_names) / sizeof(morph_names[0])) return false;
+        char *end = NULL;
+        errno = 0;
+        long w = strtol(colon + 1, &end, 10);
+        if (errno || end == colon + 1 || w < 1 || w > 100001 || w % 2 == 0) return false;
+        opt->morph[opt->nmorph].op = (MorphKind)k;
+        opt->morph[opt->nmorph++].w = (unsigned)w;
+        if (!*end) return true;
+        if (*end != ',') return false;
+        p = end + 1;
+    }
+}
+
+/* Parse "slope/window" for --ground. */
+static bool parse_ground(const char *s, Options *opt) {
+    char *end = NULL;
+    errno = 0; opt->ground_slope = strtod(s, &end);
+    if (errno || end == s || *end != '/' || !(opt->ground_slope >= 0)) return false;
+    const char *p = end + 1;
+    errno = 0; opt->ground_window = strtod(p, &end);
+    if (errno || end == p || *end || !(opt->ground_window > 0) || !isfinite(opt->ground_window)) return false;
+    return isfinite(opt->ground_slope);
+}
+
+/* Parse "nn" or "idw:R" for --fill. */
+static bool parse_fill(const char *s, Options *opt) {
+    if (!strcmp(s, "nn")) { opt->fill = FILL_NN; return true; }
+    if (strncmp(s, "idw:", 4)) return false;
+    char *end = NULL;
+    errno = 0; opt->fill_radius = strtod(s + 4, &end);
+    if (errno || end == s + 4 || *end || !(opt->fill_radius > 0) || !isfinite(opt->fill_radius)) return false;
+    opt->fill = FILL_IDW;
+    return true;
+}
+
+/* Parse "N[:levels]" for --quadtree. */
+static bool parse_quadtree(const char *s, Options *opt) {
+    char *end = NULL;
+    errno = 0;
+    long n = strtol(s, &end, 10);
+    if (errno || end == s || n < 1 || n > 1000000) return false;
+    opt->qt_split = (unsigned)n;
+    opt->qt_levels = 3;
+    if (!*end) return true;
+    if (*end != ':') return false;
+    const char *p = end + 1;
+    errno = 0;
+    long l = strtol(p, &end, 10);
+    if (errno || end == p || *end || l < 1 || l > 16) return false;
+    opt->qt_levels = (unsigned)l;
+    return true;
+}
+
+/* Parse "c1,c2,..." for --zcols. */
+static bool parse_zcols(const char *s, Options *opt) {
+    opt->nband = 0;
+    for (const char *p = s; ; ) {
+        char *end = NULL;
+        errno = 0;
+        long c = strtol(p, &end, 10);
+        if (errno || end == p || c < 3 || c > 1000 || opt->nband == BAND_MAX) return false;
+        opt->zcol[opt->nband++] = (int)c;
+        if (!*end) return true;
+        if (*end != ',') return false;
+        p = end + 1;
+    }
+}
+
+/* Exact reciprocal of inc when inc is a power of two (1, 0.5, 0.25, 2, ...)
+   and that reciprocal is a normal double; 0 otherwise.
+
+   For such inc, d / inc == d * (1/inc) bit for bit, for every double d:
+   1/inc = 2^-k is itself exact, so both sides are the correctly rounded
+   value of the same real number d * 2^-k under the same rounding mode.
+   That holds through overflow, gradual underflow, signed zeros, infinities
+   and NaN. The snapping code can therefore multiply instead of divide
+   without changing a single cell assignment. */
+static double pow2_reciprocal(double inc) {
+    int e;
+    if (!isfinite(inc) || frexp(inc, &e) != 0.5) return 0.0;
+    double inv = 1.0 / inc;
+    return isnormal(inv) ? inv : 0.0;
+}
+
 static char *dupstr(const char *s) {
     if (!s) return NULL;
     size_t n = strlen(s) + 1;
@@ -142,17 +529,32 @@ static char *dupstr(const char *s) {
 static Options parse_args(int argc, char **argv) {
     Options opt;
     memset(&opt, 0, sizeof(opt));
-    opt.find_min = true;
+    opt.reducer = RED_MIN;
     opt.inc = 1.0;
     opt.tcl_round = false;
     opt.tcl_fmt = false;
     opt.gmt_bin = false;
+    opt.engine = ENGINE_DEFAULT;
+    opt.sort_above = 512.0 * 1048576.0;
+    opt.prefetch = -1;
+    opt.stats = false;
+    opt.snapshot_every = 5.0;
+    opt.nband = 1;
+    opt.tile_size = 256;
+    opt.tile_levels = 1;
+    opt.zcol[0] = 3;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    opt.threads = ncpu > 0 ? (int)ncpu : 1;
 
     for (int i = 1; i < argc; ++i) {
         const char *a = argv[i];
         if (!strcmp(a, "-h") || !strcmp(a, "--help")) {
             usage(stdout); exit(EXIT_SUCCESS);
+        } else if (!strcmp(a, "-Rauto") || !strcmp(a, "-Rauto+s")) {
+            opt.region_auto = true;
+            opt.region_snap = a[6] == '+';
         } else if (!strncmp(a, "-R", 2) || !strncmp(a, "R", 1)) {
+            opt.region_auto = false;
             if (!parse_region(a, &opt.xmin, &opt.xmax, &opt.ymin, &opt.ymax)) {
                 fprintf(stderr, "Invalid -R region: %s\n", a);
                 exit(EXIT_FAILURE);
@@ -169,7 +571,14 @@ static Options parse_args(int argc, char **argv) {
             if (i + 1 >= argc) { fprintf(stderr, "Missing value for %s\n", a); exit(EXIT_FAILURE);} 
             opt.path = dupstr(argv[++i]);
         } else if (!strcmp(a, "-MAX")) {
-            opt.find_min = false;
+            opt.reducer = RED_MAX;
+        } else if (!strcmp(a, "--reducer")) {
+            if (i + 1 >= argc) { fprintf(stderr, "Missing value for --reducer\n"); exit(EXIT_FAILURE);} 
+            const char *r = argv[++i];
+            size_t k = 0;
+            while (k < sizeof(reducer_names) / sizeof(reducer_names[0]) && strcmp(r, reducer_names[k])) ++k;
+            if (k == sizeof(reducer_names) / sizeof(reducer_names[0])) { fprintf(stderr, "Unknown reducer: %s\n", r); exit(EXIT_FAILURE);} 
+            opt.reducer = (ReducerKind)k;
         } else if (!strcmp(a, "-o")) {
             if (i + 1 >= argc) { fprintf(stderr, "Missing value for -o\n"); exit(EXIT_FAILURE);} 
             opt.out = dupstr(argv[++i]);
@@ -179,6 +588,142 @@ static Options parse_args(int argc, char **argv) {
             opt.tcl_fmt = true;
         } else if (!strcmp(a, "--gmtbin")) {
             opt.gmt_bin = true;
+        } else if (!strcmp(a, "--engine")) {
+            if (i + 1 >= argc) { fprintf(stderr, "Missing value for --engine\n"); exit(EXIT_FAILURE);} 
+            const char *e = argv[++i];
+            if (!strcmp(e, "auto")) opt.engine = ENGINE_AUTO;
+            else if (!strcmp(e, "dense")) opt.engine = ENGINE_DENSE;
+            else if (!strcmp(e, "sort")) opt.engine = ENGINE_SORT;
+            else { fprintf(stderr, "Unknown engine: %s\n", e); exit(EXIT_FAILURE);} 
+        } else if (!strcmp(a, "--sort-above")) {
+            double v = 0.0;
+            if (!parse_double_arg(a, i + 1 < argc ? argv[i + 1] : NULL, &v)) { fprintf(stderr, "Missing value for --sort-above\n"); exit(EXIT_FAILURE);} 
+            ++i;
+            if (v < 0.0) { fprintf(stderr, "--sort-above must be >= 0\n"); exit(EXIT_FAILURE);} 
+            opt.sort_above = v * 1048576.0;
+        } else if (!strcmp(a, "--prefetch")) {
+            double v = 0.0;
+            if (!parse_double_arg(a, i + 1 < argc ? argv[i + 1] : NULL, &v)) { fprintf(stderr, "Missing value for --prefetch\n"); exit(EXIT_FAILURE);} 
+            ++i;
+            if (v < 0.0 || v >= (double)BATCH_RECS) { fprintf(stderr, "--prefetch must be in 0..%d\n", BATCH_RECS - 1); exit(EXIT_FAILURE);} 
+            opt.prefetch = (int)v;
+        } else if (!strcmp(a, "--no-simd")) {
+            opt.no_simd = true;
+        } else if (!strcmp(a, "--read-once")) {
+            opt.read_once = true;
+        } else if (!strcmp(a, "--no-runs")) {
+            opt.no_runs = true;
+        } else if (!strcmp(a, "--stats")) {
+            opt.stats = true;
+        } else if (!strcmp(a, "--threads")) {
+            double v = 0.0;
+            if (i + 1 >= argc || !parse_double_arg(a, argv[i + 1], &v)) { fprintf(stderr, "Missing value for --threads\n"); exit(EXIT_FAILURE);} 
+            ++i;
+            if (v < 1.0 || v > 1024.0 || v != floor(v)) { fprintf(stderr, "--threads must be in 1..1024\n"); exit(EXIT_FAILURE);} 
+            opt.threads = (int)v;
+        } else if (!strcmp(a, "--snapshot")) {
+            if (i + 1 >= argc) { fprintf(stderr, "Missing value for --snapshot\n"); exit(EXIT_FAILURE);} 
+            opt.snapshot = dupstr(argv[++i]);
+        } else if (!strcmp(a, "--snapshot-every")) {
+            if (!parse_double_arg(a, i + 1 < argc ? argv[i + 1] : NULL, &opt.snapshot_every)) { fprintf(stderr, "Missing value for --snapshot-every\n"); exit(EXIT_FAILURE);} 
+            ++i;
+            if (!(opt.snapshot_every > 0.0)) { fprintf(stderr, "--snapshot-every must be > 0\n"); exit(EXIT_FAILURE);} 
+        } else if (!strcmp(a, "--shm")) {
+            if (i + 1 >= argc) { fprintf(stderr, "Missing value for --shm\n"); exit(EXIT_FAILURE);} 
+            const char *v = argv[++i];
+            size_t n = strlen(v) + 2;
+            free(opt.shm);
+            opt.shm = (char*)malloc(n);
+            if (!opt.shm) die("Out of memory");
+            snprintf(opt.shm, n, "%s%s", v[0] == '/' ? "" : "/", v);
+        } else if (!strcmp(a, "--grid-file")) {
+            if (i + 1 >= argc) { fprintf(stderr, "Missing value for --grid-file\n"); exit(EXIT_FAILURE);}
+            free(opt.grid_file);
+            opt.grid_file = dupstr(argv[++i]);
+        } else if (!strncmp(a, "-Z", 2)) {
+            /* Accept "-Z 0/100" and "-Z0/100" */
+            const char *val = a[2] ? a + 2 : i + 1 < argc ? argv[++i] : NULL;
+            if (!val || !parse_zrange(val, &opt.zmin, &opt.zmax)) { fprintf(stderr, "Invalid value for -Z: %s\n", val ? val : "(missing)"); exit(EXIT_FAILURE);} 
+            opt.zfilter = true;
+        } else if (!strcmp(a, "--clip")) {
+            if (i + 1 >= argc) { fprintf(stderr, "Missing value for --clip\n"); exit(EXIT_FAILURE);} 
+            ++i;
+            if (!parse_region(argv[i], &opt.cxmin, &opt.cxmax, &opt.cymin, &opt.cymax) ||
+                !(opt.cxmin <= opt.cxmax && opt.cymin <= opt.cymax)) {
+                fprintf(stderr, "Invalid --clip box: %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+            opt.clip = true;
+        } else if (!strcmp(a, "--mask")) {
+            if (i + 1 >= argc) { fprintf(stderr, "Missing value for --mask\n"); exit(EXIT_FAILURE);} 
+            free(opt.mask);
+            opt.mask = dupstr(argv[++i]);
+        } else if (!strcmp(a, "--groupby")) {
+            if (i + 1 >= argc) { fprintf(stderr, "Missing value for --groupby\n"); exit(EXIT_FAILURE);} 
+            ++i;
+            if (opt.group_col || !parse_groupby(argv[i], &opt)) { fprintf(stderr, "Invalid value for --groupby: %s\n", argv[i]); exit(EXIT_FAILURE);} 
+        } else if (!strcmp(a, "--diff")) {
+            if (i + 1 >= argc) { fprintf(stderr, "Missing value for --diff\n"); exit(EXIT_FAILURE);} 
+            free(opt.diff);
+            opt.diff = dupstr(argv[++i]);
+        } else if (!strcmp(a, "--ground")) {
+            if (i + 1 >= argc) { fprintf(stderr, "Missing value for --ground\n"); exit(EXIT_FAILURE);} 
+            ++i;
+            if (!parse_ground(argv[i], &opt)) { fprintf(stderr, "Invalid value for --ground: %s\n", argv[i]); exit(EXIT_FAILURE);} 
+            opt.ground = true;
+        } else if (!strcmp(a, "--fill")) {
+            if (i + 1 >= argc) { fprintf(stderr, "Missing value for --fill\n"); exit(EXIT_FAILURE);} 
+            ++i;
+            if (!parse_fill(argv[i], &opt)) { fprintf(stderr, "Invalid value for --fill: %s\n", argv[i]); exit(EXIT_FAILURE);} 
+        } else if (!strcmp(a, "--quadtree")) {
+            if (i + 1 >= argc) { fprintf(stderr, "Missing value for --quadtree\n"); exit(EXIT_FAILURE);} 
+            ++i;
+            if (!parse_quadtree(argv[i], &opt)) { fprintf(stderr, "Invalid value for --quadtree: %s\n", argv[i]); exit(EXIT_FAILURE);} 
+        } else if (!strcmp(a, "--seed")) {
+            if (i + 1 >= argc) { fprintf(stderr, "Missing value for --seed\n"); exit(EXIT_FAILURE);}
+            free(opt.seed);
+            opt.seed = dupstr(argv[++i]);
+        } else if (!strcmp(a, "--delta")) {
+            opt.delta = true;
+        } else if (!strcmp(a, "--tiles")) {
+            if (i + 1 >= argc) { fprintf(stderr, "Missing value for --tiles\n"); exit(EXIT_FAILURE);} 
+            free(opt.tiles);
+            opt.tiles = dupstr(argv[++i]);
+        } else if (!strcmp(a, "--tile-size")) {
+            double v = 0.0;
+            if (i + 1 >= argc || !parse_double_arg(a, argv[i + 1], &v)) { fprintf(stderr, "Missing value for --tile-size\n"); exit(EXIT_FAILURE);} 
+            ++i;
+            if (v < 1.0 || v > 65536.0 || v != floor(v)) { fprintf(stderr, "--tile-size must be in 1..65536\n"); exit(EXIT_FAILURE);} 
+            opt.tile_size = (unsigned)v;
+        } else if (!strcmp(a, "--tile-levels")) {
+            double v = 0.0;
+            if (i + 1 >= argc || !parse_double_arg(a, argv[i + 1], &v)) { fprintf(stderr, "Missing value for --tile-levels\n"); exit(EXIT_FAILURE);} 
+            ++i;
+            if (v < 1.0 || v > 24.0 || v != floor(v)) { fprintf(stderr, "--tile-levels must be in 1..24\n"); exit(EXIT_FAILURE);} 
+            opt.tile_levels = (unsigned)v;
+        } else if (!strcmp(a, "--tile-format")) {
+            if (i + 1 >= argc) { fprintf(stderr, "Missing value for --tile-format\n"); exit(EXIT_FAILURE);} 
+            const char *v = argv[++i];
+            if (!strcmp(v, "text")) opt.tile_f32 = false;
+            else if (!strcmp(v, "f32")) opt.tile_f32 = true;
+            else { fprintf(stderr, "Invalid value for --tile-format: %s\n", v); exit(EXIT_FAILURE);} 
+        } else if (!strcmp(a, "--morph")) {
+            if (i + 1 >= argc) { fprintf(stderr, "Missing value for --morph\n"); exit(EXIT_FAILURE);} 
+            ++i;
+            if (!parse_morph(argv[i], &opt)) { fprintf(stderr, "Invalid value for --morph: %s\n", argv[i]); exit(EXIT_FAILURE);} 
+        } else if (!strcmp(a, "--zcols")) {
+            if (i + 1 >= argc) { fprintf(stderr, "Missing value for --zcols\n"); exit(EXIT_FAILURE);} 
+            ++i;
+            if (!parse_zcols(argv[i], &opt)) { fprintf(stderr, "Invalid value for --zcols: %s\n", argv[i]); exit(EXIT_FAILURE);} 
+        } else if (!strcmp(a, "--preview")) {
+            if (i + 1 >= argc) { fprintf(stderr, "Missing value for --preview\n"); exit(EXIT_FAILURE);} 
+            const char *v = argv[++i];
+            char *end = NULL;
+            errno = 0; unsigned long n = strtoul(v, &end, 10);
+            if (errno || end == v || n < 1 || n > 1000000) { fprintf(stderr, "Invalid value for --preview: %s\n", v); exit(EXIT_FAILURE);} 
+            if (!strcmp(end, "+r")) opt.preview_random = true;
+            else if (*end) { fprintf(stderr, "Invalid value for --preview: %s\n", v); exit(EXIT_FAILURE);} 
+            opt.preview = (unsigned)n;
         } else if (a[0] == '-') {
             fprintf(stderr, "Unknown option: %s\n", a);
             usage(stderr);
@@ -197,17 +742,83 @@ static Options parse_args(int argc, char **argv) {
         fprintf(stderr, "Missing input path (-PATH).\n");
         usage(stderr); exit(EXIT_FAILURE);
     }
-    if (!(opt.xmax > opt.xmin && opt.ymax > opt.ymin)) {
+    if (opt.preview && opt.region_auto) {
+        fprintf(stderr, "--preview cannot be combined with -Rauto (the pre-scan reads the whole input).\n");
+        exit(EXIT_FAILURE);
+    }
+    if (opt.snapshot && opt.reducer == RED_MODE) {
+        fprintf(stderr, "--snapshot cannot be combined with --reducer mode (cells are reduced after ingest).\n");
+        exit(EXIT_FAILURE);
+    }
+    if (opt.snapshot && (opt.shm || opt.grid_file)) {
+        fprintf(stderr, "--snapshot needs the grid in private memory; it cannot be combined with --shm\n"
+                        "or --grid-file (whose readers see the grid as it fills).\n");
+        exit(EXIT_FAILURE);
+    }
+    if (opt.group_col && (opt.snapshot || opt.shm)) {
+        fprintf(stderr, "--groupby writes one grid per group; it cannot be combined with --snapshot or --shm.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (opt.nband > 1 && (opt.snapshot || opt.shm)) {
+        fprintf(stderr, "--zcols with more than one column cannot be combined with --snapshot or --shm.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (opt.diff && (opt.region_auto || opt.preview || opt.snapshot || opt.shm || opt.group_col || opt.nband > 1)) {
+        fprintf(stderr, "--diff needs an explicit -R and cannot be combined with --preview, --snapshot,\n"
+                        "--shm, --groupby or --zcols.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (opt.grid_file && (opt.shm || opt.group_col || opt.nband > 1 || opt.diff || opt.qt_split)) {
+        fprintf(stderr, "--grid-file holds one grid; it cannot be combined with --shm, --groupby,\n"
+                        "--zcols, --diff or --quadtree.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (opt.qt_split && (opt.reducer != RED_MIN && opt.reducer != RED_MAX)) {
+        fprintf(stderr, "--quadtree keeps the min and max per block; use --reducer min or max.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (opt.qt_split && (opt.tcl_fmt || opt.snapshot || opt.shm || opt.group_col || opt.nband > 1 ||
+                         opt.diff || opt.ground || opt.nmorph || opt.fill)) {
+        fprintf(stderr, "--quadtree writes blocks, not a grid; it cannot be combined with --tclfmt,\n"
+                        "--snapshot, --shm, --groupby, --zcols, --diff, --ground, --morph or --fill.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (opt.seed && (opt.reducer == RED_NEAREST || opt.reducer == RED_MODE)) {
+        fprintf(stderr, "--seed cannot be combined with --reducer nearest or mode (the previous\n"
+                        "output keeps neither distances nor the points).\n");
+        exit(EXIT_FAILURE);
+    }
+    if (opt.seed && (opt.region_auto || opt.group_col || opt.nband > 1 || opt.qt_split || opt.diff)) {
+        fprintf(stderr, "--seed needs an explicit -R and cannot be combined with --groupby, --zcols,\n"
+                        "--quadtree or --diff.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (opt.delta && (opt.qt_split || opt.diff || opt.ground || opt.nmorph || opt.fill)) {
+        fprintf(stderr, "--delta cannot be combined with --quadtree, --diff, --ground, --morph or --fill.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (opt.tiles && (opt.group_col || opt.nband > 1 || opt.qt_split)) {
+        fprintf(stderr, "--tiles cuts one grid; it cannot be combined with --groupby, --zcols or --quadtree.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (opt.tiles && opt.tile_levels > 1 &&
+        opt.reducer != RED_MIN && opt.reducer != RED_MAX && opt.reducer != RED_SUM) {
+        fprintf(stderr, "--tile-levels above 1 merges cells 2x2; it needs --reducer min, max or sum.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (!opt.region_auto && !(opt.xmax > opt.xmin && opt.ymax > opt.ymin)) {
         fprintf(stderr, "Invalid region; require xmax > xmin and ymax > ymin.\n");
         exit(EXIT_FAILURE);
     }
 
-    if (!opt.out) {
-        const char *suffix = opt.find_min ? ".min" : ".max";
-        size_t n = strlen(opt.path) + strlen(suffix) + 1;
+    opt.inv_inc = pow2_reciprocal(opt.inc);
+
+    if (!opt.out && !opt.shm && !opt.grid_file && !opt.tiles) {
+        const char *suffix = reducer_names[opt.reducer];
+        size_t n = strlen(opt.path) + strlen(suffix) + 7;
         opt.out = (char*)malloc(n);
         if (!opt.out) die("Out of memory");
-        snprintf(opt.out, n, "%s%s", opt.path, suffix);
+        snprintf(opt.out, n, "%s.%s%s", opt.path, suffix, opt.diff ? ".diff" : "");
     }
 
     return opt;
@@ -219,201 +830,3742 @@ static size_t safe_mul_size_t(size_t a, size_t b) {
     return a * b;
 }
 
-int main(int argc, char **argv) {
-    Options opt = parse_args(argc, argv);
+/* ------------------------------------------------------------------------ */
+/* Input reading                                                             */
+/* ------------------------------------------------------------------------ */
 
-    fprintf(stderr, "region %.12g %.12g %.12g %.12g\n",
-            opt.xmin, opt.xmax, opt.ymin, opt.ymax);
+/* The input is read in large chunks rather than line by line. Each chunk is
+   handed out as a span of complete lines; a trailing partial line is carried
+   over in front of the next chunk. The carry area sits directly before the
+   read area so the read target stays page aligned. */
+#define READ_CHUNK    ((size_t)4 << 20)   /* bytes per read() */
+#define LINE_MAX_LEN  ((size_t)64 << 10)  /* longest line that may straddle chunks */
+#define IO_ALIGN      ((size_t)4096)
+#define READ_DROP     ((size_t)64 << 20)  /* --read-once: page cache released per step */
 
-    const double inc = opt.inc;
+/* --read-once. The input is read front to back exactly once, so the kernel
+   is told to read ahead at full depth, and each range of pages already
+   consumed is released from the page cache rather than displacing the data
+   of other jobs. These are hints; failures are ignored. (O_DIRECT would
+   give up readahead and is refused by tmpfs and some network filesystems.) */
+static void input_advise(int fd) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+}
 
-    /* Compute grid dimensions. For normal (node-snapped) mode we keep node counts.
-       For GMT-bin mode, emulate GMT gridline registration node counts. */
-    size_t nx, ny;
-    if (!opt.gmt_bin) {
-        const double nx_d = floor(((opt.xmax - opt.xmin) / inc) + 0.5) + 1.0;
-        const double ny_d = floor(((opt.ymax - opt.ymin) / inc) + 0.5) + 1.0;
-        if (!(nx_d >= 1.0 && ny_d >= 1.0)) die("Computed grid dimensions invalid");
-        nx = (size_t)nx_d;
-        ny = (size_t)ny_d;
-    } else {
-        /* Node counts: n = urint(((max-min)/inc) + 1) */
-        double nxd = llround(((opt.xmax - opt.xmin) / inc)) + 1.0;
-        double nyd = llround(((opt.ymax - opt.ymin) / inc)) + 1.0;
-        if (!(nxd >= 1.0 && nyd >= 1.0)) die("Computed bin dimensions invalid");
-        nx = (size_t)nxd;
-        ny = (size_t)nyd;
-    }
+static void input_drop(int fd, size_t from, size_t to) {
+    if (to > from) posix_fadvise(fd, (off_t)from, (off_t)(to - from), POSIX_FADV_DONTNEED);
+}
 
-    fprintf(stderr, "%zu columns by %zu rows\n", nx, ny);
+typedef struct {
+    int fd;
+    char *buf;           /* LINE_MAX_LEN carry area, READ_CHUNK read area, NUL */
+    char *rem;           /* partial line left over from the previous span */
+    size_t rem_len;
+    bool skip_line;      /* discarding an overlong line up to its newline */
+    bool eof;
+    bool once;           /* --read-once */
+    unsigned long long bytes;
+    unsigned long long dropped;  /* --read-once: page cache released up to here */
+} Reader;
 
-    size_t ncell = safe_mul_size_t(nx, ny);
+static void reader_open(Reader *r, const char *path, bool once) {
+    memset(r, 0, sizeof(*r));
+    r->fd = open(path, O_RDONLY);
+    if (r->fd < 0) die_perror("Failed to open input file");
+    r->once = once;
+    if (once) input_advise(r->fd);
+    void *mem = NULL;
+    if (posix_memalign(&mem, IO_ALIGN, LINE_MAX_LEN + READ_CHUNK + IO_ALIGN) != 0)
+        die("Out of memory allocating read buffer");
+    r->buf = (char*)mem;
+}
 
-    /* Allocate grids */
-    double *grid = (double*)malloc(ncell * sizeof(double));
-    if (!grid) die("Out of memory allocating grid");
-    unsigned char *hit = (unsigned char*)calloc(ncell, sizeof(unsigned char));
-    if (!hit) die("Out of memory allocating hit mask");
-    char **grid_str = NULL;
-    if (opt.tcl_fmt) {
-        grid_str = (char**)calloc(ncell, sizeof(char*));
-        if (!grid_str) die("Out of memory allocating string grid");
-    }
+static void reader_close(Reader *r) {
+    if (r->once && r->fd >= 0) input_drop(r->fd, r->dropped, r->bytes);
+    if (r->fd >= 0) close(r->fd);
+    free(r->buf);
+    r->fd = -1;
+    r->buf = NULL;
+}
 
-    const double preset = opt.find_min ? INFINITY : -INFINITY;
-    for (size_t i = 0; i < ncell; ++i) grid[i] = preset;
-    fprintf(stderr, "initialised ar(x,y)\n");
+/* Return the next span of complete lines in [*data, *data + *len). Every line
+   in the span ends in '\n' except possibly the last line of the file, and the
+   byte after the span is writable. The span stays valid until the next call.
+   Returns false at end of input. */
+static bool reader_next(Reader *r, char **data, size_t *len) {
+    char *const area = r->buf + LINE_MAX_LEN;
+    for (;;) {
+        if (r->eof) return false;
 
-    /* Open files */
-    FILE *fin = fopen(opt.path, "r");
-    if (!fin) die_perror("Failed to open input file");
-    FILE *fout = fopen(opt.out, "w");
-    if (!fout) die_perror("Failed to open output file");
-
-    /* Stream input lines */
-    char line[16384];
-    size_t lines = 0, Mlines = 0;
-    while (fgets(line, sizeof(line), fin)) {
-        /* Skip comments/blank */
-        const char *p = line;
-        while (*p == ' ' || *p == '\t') ++p;
-        if (*p == '\0' || *p == '\n' || *p == '#') continue;
+        /* Move the previous partial line in front of the read area. */
+        char *start = area - r->rem_len;
+        if (r->rem_len) memmove(start, r->rem, r->rem_len);
+        r->rem_len = 0;
 
-        char *end = NULL;
-        errno = 0; double x = strtod(p, &end);
-        if (errno || end == p) continue; /* skip malformed line */
-
-        p = end;
-        errno = 0; double y = strtod(p, &end);
-        if (errno || end == p) continue;
-
-        p = end;
-        /* Capture z token string (trim leading spaces) when needed */
-        const char *p_z_token = p;
-        while (*p_z_token == ' ' || *p_z_token == '\t') ++p_z_token;
-        errno = 0; double z = strtod(p, &end);
-        if (errno || end == p) continue;
-
-        /* Map to grid cell index according to selected policy. */
-        long long ix_ll, iy_ll;
-        if (opt.gmt_bin) {
-            /* GMT gridline registration mapping using lrint rounding macros:
-               col = irint(((x - xmin)/inc) - off) with off=0; row = n_rows-1 - irint(((y - ymin)/inc) - off). */
-            long long col_ll = (long long)lrint(((x - opt.xmin) / inc));
-            long long row_ll = (long long)((long long)ny - 1 - lrint(((y - opt.ymin) / inc)));
-            if (col_ll < 0 || (unsigned long long)col_ll >= nx || row_ll < 0 || (unsigned long long)row_ll >= ny) {
-                continue; /* Skip points outside region */
-            }
-            ix_ll = col_ll;
-            iy_ll = row_ll;
-        } else if (!opt.tcl_round) {
-            ix_ll = llround((x - opt.xmin) / inc);
-            iy_ll = llround((y - opt.ymin) / inc);
-            if (ix_ll < 0) ix_ll = 0; else if ((unsigned long long)ix_ll >= nx) ix_ll = (long long)nx - 1;
-            if (iy_ll < 0) iy_ll = 0; else if ((unsigned long long)iy_ll >= ny) iy_ll = (long long)ny - 1;
-        } else {
-            /* Emulate Tcl's findClosestValue: choose the nearest grid value;
-               if exactly between two cells, prefer the lower (smaller coord). */
-            const double tx = (x - opt.xmin) / inc;
-            const double ty = (y - opt.ymin) / inc;
-            const double fx = floor(tx), fy = floor(ty);
-            const double fracx = tx - fx, fracy = ty - fy;
-            const double eps = 1e-12;
-            ix_ll = (long long)((fracx > 0.5 + eps) ? (fx + 1.0) : (fx));
-            iy_ll = (long long)((fracy > 0.5 + eps) ? (fy + 1.0) : (fy));
-            if (ix_ll < 0) ix_ll = 0; else if ((unsigned long long)ix_ll >= nx) ix_ll = (long long)nx - 1;
-            if (iy_ll < 0) iy_ll = 0; else if ((unsigned long long)iy_ll >= ny) iy_ll = (long long)ny - 1;
-        }
-
-        size_t ix = (size_t)ix_ll;
-        size_t iy = (size_t)iy_ll;
-        size_t idx = ix + (size_t)nx * iy;
-
-        if (opt.find_min) {
-            if (!hit[idx] || z < grid[idx]) {
-                grid[idx] = z;
-                if (grid_str) {
-                    size_t tok_len = (size_t)(end - p_z_token);
-                    /* trim trailing spaces/newlines from token if any */
-                    while (tok_len > 0 && (p_z_token[tok_len-1] == '\r' || p_z_token[tok_len-1] == '\n' || p_z_token[tok_len-1] == '\t' || p_z_token[tok_len-1] == ' '))
-                        --tok_len;
-                    char *s = (char*)malloc(tok_len + 1);
-                    if (!s) die("Out of memory duplicating token");
-                    memcpy(s, p_z_token, tok_len);
-                    s[tok_len] = '\0';
-                    if (grid_str[idx]) free(grid_str[idx]);
-                    grid_str[idx] = s;
-                }
+        ssize_t n;
+        do { n = read(r->fd, area, READ_CHUNK); } while (n < 0 && errno == EINTR);
+        if (n < 0) die_perror("Failed to read input file");
+        r->bytes += (unsigned long long)n;
+        if (r->once && r->bytes - r->dropped >= READ_DROP) {
+            input_drop(r->fd, r->dropped, r->bytes);
+            r->dropped = r->bytes;
+        }
+        char *end = area + n;
+
+        if (n == 0) {
+            r->eof = true;
+            if (start == end || r->skip_line) return false;
+            *end = '\0';
+            *data = start;
+            *len = (size_t)(end - start);
+            return true;
+        }
+
+        if (r->skip_line) {
+            char *nl = memchr(start, '\n', (size_t)(end - start));
+            if (!nl) continue;
+            start = nl + 1;
+            r->skip_line = false;
+        }
+
+        char *last = end;
+        while (last > start && last[-1] != '\n') --last;
+        if (last == start) {
+            /* No newline in this chunk: the whole thing is a partial line. */
+            if ((size_t)(end - start) > LINE_MAX_LEN) {
+                fprintf(stderr, "skipping line longer than %zu bytes\n", LINE_MAX_LEN);
+                r->skip_line = true;
+            } else {
+                r->rem = start;
+                r->rem_len = (size_t)(end - start);
             }
+            continue;
+        }
+        if ((size_t)(end - last) > LINE_MAX_LEN) {
+            fprintf(stderr, "skipping line longer than %zu bytes\n", LINE_MAX_LEN);
+            r->skip_line = true;
         } else {
-            if (!hit[idx] || z > grid[idx]) {
-                grid[idx] = z;
-                if (grid_str) {
-                    size_t tok_len = (size_t)(end - p_z_token);
-                    while (tok_len > 0 && (p_z_token[tok_len-1] == '\r' || p_z_token[tok_len-1] == '\n' || p_z_token[tok_len-1] == '\t' || p_z_token[tok_len-1] == ' '))
-                        --tok_len;
-                    char *s = (char*)malloc(tok_len + 1);
-                    if (!s) die("Out of memory duplicating token");
-                    memcpy(s, p_z_token, tok_len);
-                    s[tok_len] = '\0';
-                    if (grid_str[idx]) free(grid_str[idx]);
-                    grid_str[idx] = s;
-                }
-            }
+            r->rem = last;
+            r->rem_len = (size_t)(end - last);
+        }
+        *data = start;
+        *len = (size_t)(last - start);
+        return true;
+    }
+}
+
+/* ------------------------------------------------------------------------ */
+/* Grid and binning                                                          */
+/* ------------------------------------------------------------------------ */
+
+/* Layout of the --shm object and the --grid-file: this header, then ny rows
+   of nx float64 values starting at data_offset. Row 0 is the ymin row, or
+   the ymax row when row_order is 1 (--gmtbin). ready is set to 1 (with
+   release ordering) once the grid is final. In a --shm object cells without
+   data hold NaN (empty). A --grid-file also holds the hit bytes (see Grid)
+   at hit_offset and sets SHM_EMPTY_BY_HIT in flags: a cell is empty when
+   its hit byte is 0, and its value is NaN or, in a page of values without
+   any data (left a hole), 0. Version 2 added hit_offset and flags; both
+   are 0 for --shm. */
+#define SHM_MAGIC    "BMMGRID"
+#define SHM_VERSION  2u
+#define SHM_DATA_OFF ((size_t)4096)
+#define SHM_EMPTY_BY_HIT 1u
+
+typedef struct {
+    char magic[8];       /* SHM_MAGIC, NUL padded */
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t nx, ny;
+    double xmin, xmax, ymin, ymax;
+    double inc;
+    uint32_t row_order;  /* 0: row 0 at ymin; 1: row 0 at ymax */
+    uint32_t dtype;      /* 1: float64 */
+    double empty;        /* NaN; see flags */
+    uint64_t data_offset;
+    uint64_t ready;
+    uint64_t hit_offset; /* --grid-file: ncell hit bytes; 0 without */
+    uint64_t flags;      /* SHM_EMPTY_BY_HIT: test the hit bytes, not the value */
+} ShmHeader;
+
+/* z token as written, for --tclfmt, in a fixed 10-byte slot (see ztok_scan()).
+   Plain decimals are packed (lo bit 63 clear):
+     lo  0..52   decimal significand: every digit, dot removed (< 2^53)
+     lo 53..56   digit count - 1, leading zeros included (1..16 digits)
+     lo 57..61   digits before the '.' + 1, or 0 without a '.'
+     hi  0..4    sign (none, '-', '+') * 7 + exponent form (none, or 'e'/'E'
+                 each with no, '+' or '-' exponent sign)
+     hi  5..15   exponent digits: d, 10 + dd or 110 + ddd (leading zeros kept)
+   Anything else (inf, nan, hex floats, longer significands or exponents) is
+   text (lo bit 63 set): lo 0..62 and hi bit 0 hold a pointer, hi bit 15 is
+   set when it is an owned NUL-terminated copy, otherwise it borrows
+   hi 1..14 bytes of the input (ZTOK_LEN_LONG: measure again). */
+typedef struct __attribute__((packed)) {
+    uint64_t lo;
+    uint16_t hi;
+} ZTok;
+
+#define ZTOK_TEXT_MAX  32        /* formatted packed token, with NUL */
+#define ZTOK_LEN_LONG  0x3FFFu
+
+typedef struct {
+    size_t nx, ny, ncell;
+    double *grid;          /* reduced z per cell */
+    unsigned char *hit;    /* 0 empty; 1 a point was taken (this run); 2 filled by
+                              --fill; 3 loaded by --seed and not changed since */
+    ZTok *grid_tok;        /* --tclfmt: z token of the winning point */
+    double *key;           /* --reducer nearest: squared distance of the held point */
+    ReducerKind red;
+    ShmHeader *shm;        /* --shm, --grid-file: grid lives in this mapping */
+    size_t map_len;
+} Grid;
+
+typedef struct {
+    unsigned long long points;     /* lines that parsed as x y z */
+    unsigned long long dropped;    /* points outside -R with --gmtbin */
+    unsigned long long malformed;  /* non-comment lines that failed to parse */
+    unsigned long long filtered;   /* points rejected by -Z, --clip or --mask */
+} Counters;
+
+/* Input profile gathered from the first chunk for --engine auto. */
+typedef struct {
+    size_t bytes;        /* bytes sampled */
+    size_t points;       /* points that mapped to a cell */
+    size_t same;         /* consecutive points in the same cell */
+    size_t neighbour;    /* consecutive points in an adjacent cell */
+    size_t distinct;     /* distinct cells touched by the sample */
+    size_t *cells;       /* cell indices, while sampling */
+    size_t cap;
+    size_t pix, piy;     /* previous cell */
+} Profile;
+
+/* Point record buffered by the sort engine. */
+typedef struct {
+    size_t idx;
+    double z;
+    double key;          /* --reducer nearest: squared distance to the cell node */
+    ZTok tok;            /* --tclfmt: z token; text borrows the input until flushed */
+} Rec;
+
+typedef struct {
+    Rec rec[BATCH_RECS];
+    size_t n;
+    unsigned dist;       /* prefetch distance */
+    bool on;             /* batching enabled */
+    bool simd;           /* apply with the AVX-512 kernel */
+} Batch;
+
+typedef struct {
+    Rec *rec, *tmp;
+    size_t n, cap;
+    unsigned top_bits;   /* bits spanned by the largest cell index */
+    unsigned long long flushes;
+} SortBuf;
+
+/* Same-cell run accumulator. Scan-ordered input puts long runs of points in
+   one cell; the run is reduced here and reaches the engine once. */
+#define RUN_HIST 16      /* run lengths 1, 2-3, 4-7, ..., >= 2^15 */
+
+typedef struct {
+    size_t idx;          /* current cell, SIZE_MAX when empty */
+    double z, key;
+    ZTok tok;
+    size_t len;
+    unsigned long long hist[RUN_HIST];
+} RunAcc;
+
+/* --reducer mode: every point is logged and the log is reduced after ingest. */
+typedef struct {
+    size_t idx;
+    double z;
+    size_t seq;          /* input order */
+    ZTok tok;            /* --tclfmt: z token (text is an owned copy) */
+} ModeRec;
+
+typedef struct {
+    ModeRec *rec;
+    size_t n, cap;
+} ModeLog;
+
+/* One output grid and the engine state that updates it. A plain run has one
+   layer per --zcols column (band); --groupby has that many per group, created
+   when the group first occurs. */
+typedef struct {
+    Grid g;
+    SortBuf sort;                  /* ENGINE_SORT record buffer */
+    Batch batch;                   /* ENGINE_DENSE prefetching batch */
+    RunAcc run;
+    ModeLog mode;                  /* --reducer mode */
+    double group;                  /* --groupby: the value, or the range index */
+    unsigned long long points;     /* points binned into this layer */
+} Layer;
+
+typedef struct Snapshot Snapshot;
+typedef struct Quadtree Quadtree;
+
+typedef struct {
+    const Options *opt;
+    const Grid *shape;             /* dimensions and reducer shared by every layer */
+    Layer **layer;                 /* bands of group 0, then group 1, ...; NULL until it occurs */
+    size_t nlayer;
+    size_t last;                   /* --groupby: group of the previous point */
+    Snapshot *snap;                /* --snapshot writer, or NULL */
+    Counters cnt;
+    size_t lines, Mlines;          /* progress reporting */
+    EngineKind engine;             /* engine actually used */
+    char reason[256];              /* why it was chosen */
+    Profile prof;
+    bool profiled;
+    bool runs;                     /* same-cell run fast path enabled */
+    const uint64_t *mask;          /* --mask: one bit per cell, set inside */
+    Quadtree *qt;                  /* --quadtree: points go here instead of layers */
+    unsigned long long sampled_bytes;  /* --preview: bytes binned */
+    unsigned long long input_bytes;    /* --preview: size of the input */
+} Binner;
+
+static char *token_dup(const char *tok, size_t tok_len) {
+    char *s = (char*)malloc(tok_len + 1);
+    if (!s) die("Out of memory duplicating token");
+    memcpy(s, tok, tok_len);
+    s[tok_len] = '\0';
+    return s;
+}
+
+static inline bool ztok_is_text(ZTok t) { return t.lo >> 63; }
+static inline bool ztok_owned(ZTok t) { return ztok_is_text(t) && (t.hi >> 15); }
+
+static inline const char *ztok_ptr(ZTok t) {
+    return (const char*)(uintptr_t)((t.lo & ~(1ull << 63)) | (uint64_t)(t.hi & 1u) << 63);
+}
+
+static inline ZTok ztok_text(const char *p, size_t len, bool owned) {
+    const uint64_t v = (uint64_t)(uintptr_t)p;
+    ZTok t;
+    t.lo = (v & ~(1ull << 63)) | 1ull << 63;
+    t.hi = (uint16_t)((v >> 63) | (len < ZTOK_LEN_LONG ? len : ZTOK_LEN_LONG) << 1 | (owned ? 1u << 15 : 0u));
+    return t;
+}
+
+/* Turn a borrowed token into an owned copy; packed tokens are self-contained. */
+static ZTok ztok_keep(ZTok t) {
+    if (!ztok_is_text(t) || ztok_owned(t)) return t;
+    const char *p = ztok_ptr(t);
+    size_t len = (t.hi >> 1) & ZTOK_LEN_LONG;
+    if (len == ZTOK_LEN_LONG) {
+        char *end = NULL;
+        (void)strtod(p, &end);
+        len = (size_t)(end - p);
+    }
+    return ztok_text(token_dup(p, len), len, true);
+}
+
+static inline void ztok_free(ZTok t) {
+    if (ztok_owned(t)) free((void*)(uintptr_t)ztok_ptr(t));
+}
+
+/* Replace a grid slot with a winning token. Only text tokens allocate. */
+static inline void ztok_store(ZTok *slot, ZTok t) {
+    ztok_free(*slot);
+    *slot = ztok_is_text(t) ? ztok_keep(t) : t;
+}
+
+/* Text of a stored token: formatted into buf (ZTOK_TEXT_MAX bytes) when
+   packed, the owned copy otherwise. */
+static const char *ztok_format(ZTok t, char *buf) {
+    if (ztok_is_text(t)) return ztok_ptr(t);
+    uint64_t sig = t.lo & ((1ull << 53) - 1);
+    const unsigned nd = (unsigned)(t.lo >> 53 & 15u) + 1;
+    const unsigned dot = (unsigned)(t.lo >> 57 & 31u);
+    const unsigned sign = (t.hi & 31u) / 7, form = (t.hi & 31u) % 7;
+    const unsigned ecode = t.hi >> 5;
+    char dig[16];
+    for (unsigned i = nd; i-- > 0; sig /= 10) dig[i] = (char)('0' + sig % 10);
+    char *o = buf;
+    if (sign) *o++ = sign == 1 ? '-' : '+';
+    for (unsigned i = 0; i < nd; ++i) {
+        if (dot == i + 1) *o++ = '.';
+        *o++ = dig[i];
+    }
+    if (dot == nd + 1) *o++ = '.';
+    if (form) {
+        *o++ = form <= 3 ? 'e' : 'E';
+        const unsigned es = (form - 1) % 3;
+        if (es) *o++ = es == 1 ? '+' : '-';
+        const unsigned ed = ecode < 10 ? 1 : ecode < 110 ? 2 : 3;
+        unsigned e = ecode - (ed == 1 ? 0 : ed == 2 ? 10 : 110);
+        for (unsigned i = ed; i-- > 0; e /= 10) o[i] = (char)('0' + e % 10);
+        o += ed;
+    }
+    *o = '\0';
+    return buf;
+}
+
+#define HIT_PAD 8
+
+/* Whether the grid keeps a z token per cell. */
+static bool grid_tokens(const Options *opt) {
+    return opt->tcl_fmt && opt->reducer != RED_SUM;
+}
+
+/* Offset of a section of `len` bytes placed after `off`, page aligned. */
+static size_t map_section(size_t *off, size_t len) {
+    const size_t at = *off;
+    if (len > SIZE_MAX - at - SHM_DATA_OFF) die("Grid size too large (overflow)");
+    *off = (at + len + SHM_DATA_OFF - 1) / SHM_DATA_OFF * SHM_DATA_OFF;
+    return at;
+}
+
+/* Size the object behind fd for the header, the values and hit_len bytes
+   after them, map it shared and fill in the header. */
+static void grid_map(Grid *g, const Options *opt, int fd, const char *what, size_t hit_len) {
+    size_t end = SHM_DATA_OFF;
+    map_section(&end, safe_mul_size_t(g->ncell, sizeof(double)));
+    const size_t hit_off = hit_len ? map_section(&end, hit_len) : 0;
+    g->map_len = end;
+    if (ftruncate(fd, (off_t)g->map_len) != 0) die_perror(what);
+    void *m = mmap(NULL, g->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (m == MAP_FAILED) die_perror(what);
+    close(fd);
+
+    ShmHeader *h = (ShmHeader*)m;
+    memcpy(h->magic, SHM_MAGIC, sizeof(SHM_MAGIC));
+    h->version = SHM_VERSION;
+    h->header_size = (uint32_t)sizeof(ShmHeader);
+    h->nx = g->nx;
+    h->ny = g->ny;
+    h->xmin = opt->xmin; h->xmax = opt->xmax;
+    h->ymin = opt->ymin; h->ymax = opt->ymax;
+    h->inc = opt->inc;
+    h->row_order = opt->gmt_bin ? 1u : 0u;
+    h->dtype = 1u;
+    h->empty = NAN;
+    h->data_offset = SHM_DATA_OFF;
+    h->ready = 0;
+    h->hit_offset = hit_off;
+    h->flags = hit_off ? SHM_EMPTY_BY_HIT : 0;
+    g->shm = h;
+    g->grid = (double*)((char*)m + SHM_DATA_OFF);
+}
+
+/* Create the --shm object and place the grid values in it. An object left
+   by an earlier run is unlinked rather than truncated: a consumer that
+   still maps it keeps the old grid instead of faulting (SIGBUS). */
+static void grid_map_shm(Grid *g, const Options *opt) {
+    if (shm_unlink(opt->shm) != 0 && errno != ENOENT) die_perror("Failed to replace shared memory object");
+    int fd = shm_open(opt->shm, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0) die_perror("Failed to create shared memory object");
+    grid_map(g, opt, fd, "Failed to map shared memory object", 0);
+}
+
+/* Create the --grid-file and place the values and hit bytes in it.
+   ftruncate() leaves the file sparse, so blocks are allocated as cells are
+   first written and the kernel pages the grid in and out, which lets it
+   exceed RAM. Points land in cells in input order, so readahead would only
+   pull in pages nothing asks for: the mapping is MADV_RANDOM during ingest
+   (grid_flush_file() switches it to sequential). z tokens stay in memory
+   (grid_init()): text tokens are pointers, meaningless in the file. */
+static void grid_map_file(Grid *g, const Options *opt) {
+    int fd = open(opt->grid_file, O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (fd < 0) die_perror("Failed to create grid file");
+    grid_map(g, opt, fd, "Failed to map grid file", g->ncell + HIT_PAD);
+    g->hit = (unsigned char*)g->shm + g->shm->hit_offset;
+    madvise(g->shm, g->map_len, MADV_RANDOM);
+}
+
+/* Whether the hit bytes live in the mapping too (--grid-file). */
+static bool grid_in_file(const Grid *g) {
+    return g->shm && g->shm->hit_offset;
+}
+
+/* Replace the empty-cell presets with NaN and mark the object ready. */
+static void grid_publish_shm(Grid *g) {
+    for (size_t i = 0; i < g->ncell; ++i)
+        if (!g->hit[i]) g->grid[i] = NAN;
+    __atomic_store_n(&g->shm->ready, 1, __ATOMIC_RELEASE);
+}
+
+#define GRID_FLUSH_BYTES ((size_t)32 << 20)
+
+/* Write back [off, off + len) of the mapping and drop it from the process,
+   so a grid larger than RAM doesn't stay resident while the rest is
+   flushed. */
+static void map_flush(const Grid *g, size_t off, size_t len, size_t page) {
+    if (!len) return;
+    const size_t at = off / page * page;
+    char *p = (char*)g->shm + at;
+    if (msync(p, off + len - at, MS_SYNC) != 0) die_perror("Failed to write back grid file");
+    madvise(p, off + len - at, MADV_DONTNEED);
+}
+
+/* Finish the --grid-file: set empty cells to NaN and write the mapping back
+   one band of rows at a time (values and hit bytes of the band),
+   in file order, so writeback proceeds sequentially instead of the kernel
+   flushing dirty pages from all over the file at once. A page of values
+   without any data was never written and stays a hole (reading as 0), so
+   the file stays as sparse as the data. ready is set and the header
+   written last. */
+static void grid_flush_file(Grid *g) {
+    const size_t page = (size_t)sysconf(_SC_PAGESIZE), per = page / sizeof(double);
+    const ShmHeader *h = g->shm;
+    size_t rows = GRID_FLUSH_BYTES / (g->nx * sizeof(double));
+    if (rows == 0) rows = 1;
+    madvise(g->shm, g->map_len, MADV_SEQUENTIAL);
+    for (size_t y0 = 0; y0 < g->ny; y0 += rows) {
+        const size_t y1 = y0 + rows < g->ny ? y0 + rows : g->ny;
+        const size_t i0 = y0 * g->nx, n = (y1 - y0) * g->nx;
+        for (size_t i = i0; i < i0 + n; ) {
+            const size_t e = (i / per + 1) * per < i0 + n ? (i / per + 1) * per : i0 + n;
+            size_t k = i;
+            while (k < e && !g->hit[k]) ++k;
+            if (k < e)
+                for (k = i; k < e; ++k)
+                    if (!g->hit[k]) g->grid[k] = NAN;
+            i = e;
         }
-        hit[idx] = 1;
+        map_flush(g, h->data_offset + i0 * sizeof(double), n * sizeof(double), page);
+        map_flush(g, h->hit_offset + i0, n + (y1 == g->ny ? HIT_PAD : 0), page);
+    }
+    __atomic_store_n(&g->shm->ready, 1, __ATOMIC_RELEASE);
+    if (msync(g->shm, SHM_DATA_OFF, MS_SYNC) != 0) die_perror("Failed to write back grid file");
+}
+
+/* Set the dimensions and reducer only; grid_init() also allocates. */
+static void grid_shape(Grid *g, const Options *opt, size_t nx, size_t ny) {
+    memset(g, 0, sizeof(*g));
+    g->nx = nx;
+    g->ny = ny;
+    g->ncell = safe_mul_size_t(nx, ny);
+    g->red = opt->reducer;
+}
 
-        if (++lines == 1000000) {
-            ++Mlines;
-            fprintf(stderr, "%zu,000,000 lines\n", Mlines);
-            lines = 0;
+static void grid_init(Grid *g, const Options *opt, size_t nx, size_t ny) {
+    grid_shape(g, opt, nx, ny);
+    if (opt->grid_file) {
+        grid_map_file(g, opt);
+    } else {
+        if (opt->shm) {
+            grid_map_shm(g, opt);
+        } else {
+            g->grid = (double*)malloc(safe_mul_size_t(g->ncell, sizeof(double)));
+            if (!g->grid) die("Out of memory allocating grid");
         }
+        /* Padded so the vector kernel can gather 8 bytes at any cell. */
+        g->hit = (unsigned char*)calloc(g->ncell + HIT_PAD, sizeof(unsigned char));
+        if (!g->hit) die("Out of memory allocating hit mask");
+    }
+    if (grid_tokens(opt)) {
+        g->grid_tok = (ZTok*)calloc(g->ncell, sizeof(ZTok));
+        if (!g->grid_tok) die("Out of memory allocating token grid");
+    }
+    if (opt->reducer == RED_NEAREST) {
+        /* Zeroed: dense_update loads the key of empty cells too (red_takes
+           then ignores it), and calloc keeps a large grid's pages lazy. */
+        g->key = (double*)calloc(g->ncell, sizeof(double));
+        if (!g->key) die("Out of memory allocating distance grid");
     }
-    fprintf(stderr, "updated ar(x,y) with z%s\n", opt.find_min ? "min" : "max");
+    /* Every reader tests hit first, so a --grid-file keeps its zero pages
+       unwritten rather than allocating the whole file up front. */
+    if (opt->grid_file) return;
+    const double preset = opt->reducer == RED_MIN ? INFINITY : opt->reducer == RED_MAX ? -INFINITY : 0.0;
+    for (size_t i = 0; i < g->ncell; ++i) g->grid[i] = preset;
+}
 
-    /* Write results. Only print cells that received data. */
-    fprintf(stderr, "write %s\n", opt.out);
-    for (size_t iy = 0; iy < ny; ++iy) {
-        for (size_t ix = 0; ix < nx; ++ix) {
-            size_t idx = ix + nx * iy;
-            if (!hit[idx]) continue;
-            double gx, gy;
-            if (opt.gmt_bin) {
-                /* Node coordinate for (row=iy, col=ix) under gridline registration */
-                gx = opt.xmin + (double)ix * inc;
-                gy = opt.ymax - (double)iy * inc;
-            } else {
-                gx = opt.xmin + (double)ix * inc;
-                gy = opt.ymin + (double)iy * inc;
-            }
-            double gz = grid[idx];
-            if (opt.gmt_bin) {
-                /* Match GMT table formatting expectation in compare script: x,y %.1f, z numeric */
-                fprintf(fout, "%.1f %.1f %.10g\n", gx, gy, gz);
-            } else if (!opt.tcl_fmt) {
-                /* Compact formatting */
-                fprintf(fout, "%.10g %.10g %.10g\n", gx, gy, gz);
-            } else {
-                if (grid_str && grid_str[idx]) {
-                    fprintf(fout, "%.1f %.1f %s\n", gx, gy, grid_str[idx]);
-                } else {
-                    /* Fallback if no token stored (shouldn't happen) */
-                    fprintf(fout, "%.1f %.1f %.10g\n", gx, gy, gz);
-                }
-            }
+/* Drop the token grid; the values are then written numerically. */
+static void ztok_release(Grid *g) {
+    if (!g->grid_tok) return;
+    for (size_t i = 0; i < g->ncell; ++i) ztok_free(g->grid_tok[i]);
+    free(g->grid_tok);
+    g->grid_tok = NULL;
+}
+
+static void grid_free(Grid *g) {
+    ztok_release(g);
+    if (!grid_in_file(g)) free(g->hit);
+    free(g->key);
+    if (g->shm) munmap(g->shm, g->map_len);
+    else free(g->grid);
+    memset(g, 0, sizeof(*g));
+}
+
+/* Skip blanks up to the next field on the same line. strtod() would also skip
+   a newline and carry on into the next line, so a field may only start once
+   this returns a character other than '\n' or '\0'. */
+static inline const char *skip_field_blanks(const char *p) {
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\v' || *p == '\f') ++p;
+    return p;
+}
+
+static const double pow10_exact[23] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static inline bool is_digit(char c) { return (unsigned)(c - '0') < 10u; }
+
+/* Parse the z field at p: the value, exactly as strtod() gives it, and the
+   token strtod() would consume, captured while the digits are scanned.
+   Plain decimals with at most 16 digits (significand < 2^53) and a 1-3 digit
+   exponent are packed into the ZTok. Their value comes from Clinger's fast
+   path when the decimal exponent is within 10^+-22: the significand and the
+   power of ten are then both exact doubles, so one correctly rounded multiply
+   or divide equals strtod(). Everything else, and every value outside that
+   range, goes to strtod() with the token borrowed from the input. Returns
+   false where the strtod() path would have rejected the field. */
+static inline bool ztok_scan(const char *p, double *z, ZTok *tok) {
+    const char *s = p;
+    unsigned sign = 0;
+    if (*s == '-') { sign = 1; ++s; }
+    else if (*s == '+') { sign = 2; ++s; }
+    uint64_t sig = 0;
+    unsigned nd = 0, dot = 0, frac = 0, form = 0, ed = 0, e = 0;
+    bool packed = false;
+    ZTok pk = {0, 0};
+    if (s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) goto slow;   /* hex float */
+    for (; is_digit(*s); ++s, ++nd) if (nd < 19) sig = sig * 10 + (uint64_t)(*s - '0');
+    if (*s == '.') {
+        dot = nd + 1;
+        for (++s; is_digit(*s); ++s, ++nd, ++frac) if (nd < 19) sig = sig * 10 + (uint64_t)(*s - '0');
+    }
+    if (nd == 0) goto slow;                                       /* inf, nan or not a number */
+
+    if (*s == 'e' || *s == 'E') {
+        const char *q = s + 1;
+        unsigned es = 0;
+        if (*q == '+') { es = 1; ++q; }
+        else if (*q == '-') { es = 2; ++q; }
+        if (is_digit(*q)) {
+            form = (*s == 'e' ? 1 : 4) + es;
+            for (; is_digit(*q); ++q, ++ed) if (ed < 4) e = e * 10 + (unsigned)(*q - '0');
+            s = q;
+        }
+    }
+    packed = nd <= 16 && sig < (1ull << 53) && ed <= 3;
+    if (packed) {
+        const unsigned ecode = ed == 0 ? 0 : ed == 1 ? e : ed == 2 ? 10 + e : 110 + e;
+        pk.lo = sig | (uint64_t)(nd - 1) << 53 | (uint64_t)dot << 57;
+        pk.hi = (uint16_t)((sign * 7 + form) | ecode << 5);
+        const int e10 = (form && (form - 1) % 3 == 2 ? -(int)e : (int)e) - (int)frac;
+        if (e10 >= -22 && e10 <= 22) {
+            const double w = (double)sig;
+            double v = e10 < 0 ? w / pow10_exact[-e10] : w * pow10_exact[e10];
+            *z = sign == 1 ? -v : v;
+            *tok = pk;
+            return true;
         }
     }
+slow:;
+    char *end = NULL;
+    errno = 0; *z = strtod(p, &end);
+    if (errno || end == p) return false;
+    *tok = packed && end == s ? pk : ztok_text(p, (size_t)(end - p), false);
+    return true;
+}
+
+/* Parse "x y" from a line terminated by '\n' or '\0'; *zp is set to the start
+   of the z field, which the caller parses only if the point passes the x/y
+   filters. */
+static inline bool parse_xy(const char *p, double *x, double *y, const char **zp) {
+    char *end = NULL;
+    p = skip_field_blanks(p);
+    if (*p == '\n' || *p == '\0') return false;
+    errno = 0; *x = strtod(p, &end);
+    if (errno || end == p) return false;
+
+    p = skip_field_blanks(end);
+    if (*p == '\n' || *p == '\0') return false;
+    errno = 0; *y = strtod(p, &end);
+    if (errno || end == p) return false;
+
+    p = skip_field_blanks(end);
+    if (*p == '\n' || *p == '\0') return false;
+    *zp = p;
+    return true;
+}
 
-    fclose(fout);
-    fclose(fin);
-    if (grid_str) {
-        for (size_t i = 0; i < ncell; ++i) free(grid_str[i]);
-        free(grid_str);
+/* Parse "x y z"; *tok receives the z token as written. */
+static inline bool parse_xyz(const char *p, double *x, double *y, double *z, ZTok *tok) {
+    const char *zp;
+    return parse_xy(p, x, y, &zp) && ztok_scan(zp, z, tok);
+}
+
+/* Offset from the origin in cells, (d / inc). Power-of-two increments take
+   the multiply by the exact reciprocal (see pow2_reciprocal()), which gives
+   the identical double without a divide on the per-point path. */
+static inline double cell_units(const Options *opt, double d) {
+    return opt->inv_inc != 0.0 ? d * opt->inv_inc : d / opt->inc;
+}
+
+/* Node coordinates of cell (ix, iy), as written to the output. */
+static inline void cell_node(const Options *opt, size_t ix, size_t iy, double *gx, double *gy) {
+    *gx = opt->xmin + (double)ix * opt->inc;
+    if (opt->gmt_bin) *gy = opt->ymax - (double)iy * opt->inc;   /* row 0 is ymax */
+    else *gy = opt->ymin + (double)iy * opt->inc;
+}
+
+/* Map (x, y) to a cell index according to the selected policy. Returns false
+   for points that are dropped (only with --gmtbin). */
+static inline bool map_cell(const Options *opt, size_t nx, size_t ny,
+                            double x, double y, size_t *ix_out, size_t *iy_out) {
+    long long ix_ll, iy_ll;
+    if (opt->gmt_bin) {
+        /* GMT gridline registration mapping using lrint rounding macros:
+           col = irint(((x - xmin)/inc) - off) with off=0; row = n_rows-1 - irint(((y - ymin)/inc) - off). */
+        long long col_ll = (long long)lrint(cell_units(opt, x - opt->xmin));
+        long long row_ll = (long long)((long long)ny - 1 - lrint(cell_units(opt, y - opt->ymin)));
+        if (col_ll < 0 || (unsigned long long)col_ll >= nx || row_ll < 0 || (unsigned long long)row_ll >= ny) {
+            return false; /* Skip points outside region */
+        }
+        ix_ll = col_ll;
+        iy_ll = row_ll;
+    } else if (!opt->tcl_round) {
+        ix_ll = llround(cell_units(opt, x - opt->xmin));
+        iy_ll = llround(cell_units(opt, y - opt->ymin));
+        if (ix_ll < 0) ix_ll = 0; else if ((unsigned long long)ix_ll >= nx) ix_ll = (long long)nx - 1;
+        if (iy_ll < 0) iy_ll = 0; else if ((unsigned long long)iy_ll >= ny) iy_ll = (long long)ny - 1;
+    } else {
+        /* Emulate Tcl's findClosestValue: choose the nearest grid value;
+           if exactly between two cells, prefer the lower (smaller coord). */
+        const double tx = cell_units(opt, x - opt->xmin);
+        const double ty = cell_units(opt, y - opt->ymin);
+        const double fx = floor(tx), fy = floor(ty);
+        const double fracx = tx - fx, fracy = ty - fy;
+        const double eps = 1e-12;
+        ix_ll = (long long)((fracx > 0.5 + eps) ? (fx + 1.0) : (fx));
+        iy_ll = (long long)((fracy > 0.5 + eps) ? (fy + 1.0) : (fy));
+        if (ix_ll < 0) ix_ll = 0; else if ((unsigned long long)ix_ll >= nx) ix_ll = (long long)nx - 1;
+        if (iy_ll < 0) iy_ll = 0; else if ((unsigned long long)iy_ll >= ny) iy_ll = (long long)ny - 1;
     }
-    free(hit);
-    free(grid);
+    *ix_out = (size_t)ix_ll;
+    *iy_out = (size_t)iy_ll;
+    return true;
+}
+
+/* Reducer policy. Does a point (z, key) replace the point a cell or run
+   holds (cur, cur_key)? held is false for an empty cell. Comparisons are
+   strict, so ties keep the held (earlier) point. The kernels below pass the
+   reducer as a constant and this folds to a single compare. */
+static inline bool red_takes(ReducerKind red, bool held, double cur, double cur_key,
+                             double z, double key) {
+    switch (red) {
+    case RED_MIN:     return !held || z < cur;
+    case RED_MAX:     return !held || z > cur;
+    case RED_FIRST:   return !held;
+    case RED_LAST:    return true;
+    case RED_NEAREST: return !held || key < cur_key;
+    case RED_SUM:     /* accumulates; see dense_update() */
+    case RED_MODE:    /* reduced after ingest; see mode_finish() */
+        break;
+    }
+    return false;
+}
+
+/* A point whose ordering value is NaN is taken by an empty cell but never
+   replaces a held point, so it must not seed a same-cell run. */
+static inline bool red_unordered(ReducerKind red, double z, double key) {
+    if (red == RED_MIN || red == RED_MAX) return z != z;
+    if (red == RED_NEAREST) return key != key;
+    return false;
+}
+
+/* Reducers the same-cell run accumulator reproduces exactly. A sum reduced
+   per run would round differently from the in-place sum. */
+static inline bool red_runs(ReducerKind red) {
+    return red != RED_SUM && red != RED_MODE;
+}
+
+/* Dense engine: update the cell in place. */
+static inline void dense_update(ReducerKind red, Grid *g, size_t idx, double z, double key,
+                                ZTok tok) {
+    if (red == RED_SUM) {
+        g->grid[idx] = g->hit[idx] ? g->grid[idx] + z : z;
+        g->hit[idx] = 1;
+        return;
+    }
+    if (red_takes(red, g->hit[idx], g->grid[idx], red == RED_NEAREST ? g->key[idx] : 0.0, z, key)) {
+        g->grid[idx] = z;
+        g->hit[idx] = 1;
+        if (red == RED_NEAREST) g->key[idx] = key;
+        if (g->grid_tok) ztok_store(&g->grid_tok[idx], tok);
+    }
+}
+
+/* Apply records in order: the sort engine's per-bucket reduction, one
+   instance per reducer. */
+typedef void (*RecReducer)(Grid *g, const Rec *r, size_t n);
+
+#define X(N, n) \
+    HOT_KERNEL static void reduce_recs_##n(Grid *g, const Rec *r, size_t cnt) { \
+        for (size_t i = 0; i < cnt; ++i) \
+            dense_update(RED_##N, g, r[i].idx, r[i].z, r[i].key, r[i].tok); \
+    }
+REDUCERS(X)
+#undef X
+
+static RecReducer reduce_recs_for(ReducerKind red) {
+    switch (red) {
+#define X(N, n) case RED_##N: return reduce_recs_##n;
+    REDUCERS(X)
+#undef X
+    }
+    return reduce_recs_min;
+}
+
+/* Sort engine. Records are buffered and, when the buffer fills, stably
+   radix-partitioned on the cell index until each partition spans at most
+   2^SORT_BUCKET_BITS cells (256 KiB of grid values). Each partition is then
+   reduced in input order, so the grid is swept in cache-resident ranges
+   rather than hit at random, and ties still keep the first point seen. */
+#define SORT_BUCKET_BITS 15
+#define SORT_RADIX_BITS  8
+#define SORT_BUF_RECS    ((size_t)1 << 20)
+#define SORT_MIN_PART    64   /* partitions this small are reduced directly */
+
+static void sort_init(SortBuf *sb, size_t ncell) {
+    memset(sb, 0, sizeof(*sb));
+    sb->cap = SORT_BUF_RECS;
+    sb->rec = (Rec*)malloc(sb->cap * sizeof(Rec));
+    sb->tmp = (Rec*)malloc(sb->cap * sizeof(Rec));
+    if (!sb->rec || !sb->tmp) die("Out of memory allocating sort buffer");
+    while (sb->top_bits < 64 && ((ncell - 1) >> sb->top_bits) != 0) ++sb->top_bits;
+}
+
+static void sort_free(SortBuf *sb) {
+    free(sb->rec);
+    free(sb->tmp);
+    memset(sb, 0, sizeof(*sb));
+}
+
+/* Partition a[0..n) on index bits below hi, then reduce each partition. */
+HOT_KERNEL
+static void sort_partition(Grid *g, RecReducer leaf, Rec *a, Rec *tmp, size_t n, unsigned hi) {
+    if (hi <= SORT_BUCKET_BITS || n <= SORT_MIN_PART) {
+        leaf(g, a, n);
+        return;
+    }
+    unsigned d = hi - SORT_BUCKET_BITS;
+    if (d > SORT_RADIX_BITS) d = SORT_RADIX_BITS;
+    const unsigned sh = hi - d;
+    const size_t mask = ((size_t)1 << d) - 1;
+    size_t count[1u << SORT_RADIX_BITS] = {0};
+    size_t pos[1u << SORT_RADIX_BITS];
+    for (size_t i = 0; i < n; ++i) ++count[(a[i].idx >> sh) & mask];
+    size_t off = 0;
+    for (size_t k = 0; k <= mask; ++k) { pos[k] = off; off += count[k]; }
+    for (size_t i = 0; i < n; ++i) tmp[pos[(a[i].idx >> sh) & mask]++] = a[i];
+    memcpy(a, tmp, n * sizeof(Rec));
+    off = 0;
+    for (size_t k = 0; k <= mask; ++k) {
+        if (count[k]) sort_partition(g, leaf, a + off, tmp + off, count[k], sh);
+        off += count[k];
+    }
+}
+
+static void sort_flush(SortBuf *sb, Grid *g) {
+    if (!sb->n) return;
+    sort_partition(g, reduce_recs_for(g->red), sb->rec, sb->tmp, sb->n, sb->top_bits);
+    sb->n = 0;
+    ++sb->flushes;
+}
+
+static inline void sort_push(SortBuf *sb, Grid *g, size_t idx, double z, double key, ZTok tok) {
+    Rec *r = &sb->rec[sb->n++];
+    r->idx = idx;
+    r->z = z;
+    r->key = key;
+    r->tok = tok;
+    if (sb->n == sb->cap) sort_flush(sb, g);
+}
+
+/* Return the start of the line after the one at p. */
+static inline const char *next_line(const char *p, const char *end) {
+    const char *nl = memchr(p, '\n', (size_t)(end - p));
+    return nl ? nl + 1 : end;
+}
+
+static inline bool skip_blank(const char **pp) {
+    const char *p = *pp;
+    while (*p == ' ' || *p == '\t') ++p;
+    *pp = p;
+    return *p == '\0' || *p == '\n' || *p == '\r' || *p == '#';
+}
+
+/* Batched dense updates. Records for a block of points are collected first;
+   applying the block then prefetches the grid, hit and token slots of the
+   record dist places ahead, so several independent cache misses are in
+   flight while earlier records are updated in order. */
+#ifdef HAVE_X86_SIMD
+/* AVX-512 batch kernel for --reducer min/max. Eight records at a time: gather their
+   cell values and hit bytes, use vpconflictq to find lanes whose cell already
+   occurs in an earlier lane, and update the remaining (first-occurrence)
+   lanes with a masked scatter. Lanes with an earlier duplicate are then
+   applied in lane order by the scalar update, so every cell still sees its
+   points in input order and ties keep the first one. hit bytes and tokens
+   are written per updated lane. */
+__attribute__((target("avx512f,avx512cd")))
+static void batch_apply_avx512(Batch *bt, Grid *g) {
+    const size_t n = bt->n, d = bt->dist;
+    const Rec *r = bt->rec;
+    /* Record stride in 64-bit words, for gathering idx and z out of Rec. */
+    const long long w = (long long)(sizeof(Rec) / 8);
+    const __m512i lane = _mm512_set_epi64(7 * w, 6 * w, 5 * w, 4 * w, 3 * w, 2 * w, w, 0);
+    const __m512i low_byte = _mm512_set1_epi64(0xFF);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        for (size_t k = i + d; d && k < i + d + 8 && k < n; ++k) {
+            __builtin_prefetch(&g->grid[r[k].idx], 1, 0);
+            __builtin_prefetch(&g->hit[r[k].idx], 1, 0);
+            if (g->grid_tok) __builtin_prefetch(&g->grid_tok[r[k].idx], 1, 0);
+        }
+        const __m512i vidx = _mm512_i64gather_epi64(lane, &r[i].idx, 8);
+        const __m512d vz = _mm512_i64gather_pd(lane, &r[i].z, 8);
+        const __m512i conf = _mm512_conflict_epi64(vidx);
+        const __mmask8 first = _mm512_testn_epi64_mask(conf, conf);
+        const __m512d vg = _mm512_mask_i64gather_pd(_mm512_setzero_pd(), first, vidx, g->grid, 8);
+        const __m512i vh = _mm512_mask_i64gather_epi64(_mm512_setzero_si512(), first, vidx, g->hit, 1);
+        const __mmask8 occupied = _mm512_test_epi64_mask(vh, low_byte);
+        const __mmask8 better = g->red == RED_MIN ? _mm512_cmp_pd_mask(vz, vg, _CMP_LT_OQ)
+                                                  : _mm512_cmp_pd_mask(vz, vg, _CMP_GT_OQ);
+        const __mmask8 upd = first & (__mmask8)(~occupied | better);
+        _mm512_mask_i64scatter_pd(g->grid, upd, vidx, vz, 8);
+        for (unsigned k = 0; k < 8; ++k) {
+            const Rec *rk = &r[i + k];
+            if (upd >> k & 1) {
+                if (g->grid_tok) ztok_store(&g->grid_tok[rk->idx], rk->tok);
+                g->hit[rk->idx] = 1;
+            }
+        }
+        for (unsigned k = 1; k < 8; ++k)
+            if (!(first >> k & 1)) dense_update(g->red, g, r[i + k].idx, r[i + k].z, 0.0, r[i + k].tok);
+    }
+    for (; i < n; ++i) dense_update(g->red, g, r[i].idx, r[i].z, 0.0, r[i].tok);
+    bt->n = 0;
+}
+
+static bool cpu_has_avx512(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512cd");
+}
+#else
+static bool cpu_has_avx512(void) { return false; }
+#endif
+
+static inline void batch_apply_scalar(ReducerKind red, Batch *bt, Grid *g) {
+    const size_t n = bt->n, d = bt->dist;
+    const Rec *r = bt->rec;
+    for (size_t i = 0; i < d && i < n; ++i) {
+        __builtin_prefetch(&g->grid[r[i].idx], 1, 0);
+        __builtin_prefetch(&g->hit[r[i].idx], 1, 0);
+        if (g->grid_tok) __builtin_prefetch(&g->grid_tok[r[i].idx], 1, 0);
+    }
+    for (size_t i = 0; i < n; ++i) {
+        if (i + d < n) {
+            const size_t j = r[i + d].idx;
+            __builtin_prefetch(&g->grid[j], 1, 0);
+            __builtin_prefetch(&g->hit[j], 1, 0);
+            if (g->grid_tok) __builtin_prefetch(&g->grid_tok[j], 1, 0);
+        }
+        dense_update(red, g, r[i].idx, r[i].z, r[i].key, r[i].tok);
+    }
+    bt->n = 0;
+}
+
+#define X(N, n) \
+    HOT_KERNEL static void batch_apply_##n(Batch *bt, Grid *g) { batch_apply_scalar(RED_##N, bt, g); }
+REDUCERS(X)
+#undef X
+
+static void batch_apply(Batch *bt, Grid *g) {
+#ifdef HAVE_X86_SIMD
+    if (bt->simd) { batch_apply_avx512(bt, g); return; }
+#endif
+    switch (g->red) {
+#define X(N, n) case RED_##N: batch_apply_##n(bt, g); break;
+    REDUCERS(X)
+#undef X
+    }
+}
+
+static inline void batch_push(Batch *bt, Grid *g, size_t idx, double z, double key, ZTok tok) {
+    Rec *r = &bt->rec[bt->n++];
+    r->idx = idx;
+    r->z = z;
+    r->key = key;
+    r->tok = tok;
+    if (bt->n == BATCH_RECS) batch_apply(bt, g);
+}
+
+static void snapshot_poll(Binner *b);
+
+static inline void engine_apply(ReducerKind red, const Binner *b, Layer *l, size_t idx,
+                                double z, double key, ZTok tok) {
+    if (b->engine == ENGINE_SORT) sort_push(&l->sort, &l->g, idx, z, key, tok);
+    else if (l->batch.on) batch_push(&l->batch, &l->g, idx, z, key, tok);
+    else dense_update(red, &l->g, idx, z, key, tok);
+}
+
+static inline void run_flush(ReducerKind red, const Binner *b, Layer *l) {
+    RunAcc *r = &l->run;
+    if (r->idx == SIZE_MAX) return;
+    engine_apply(red, b, l, r->idx, r->z, r->key, r->tok);
+    unsigned k = 0;
+    while (k + 1 < RUN_HIST && (r->len >> (k + 1)) != 0) ++k;
+    ++r->hist[k];
+    r->idx = SIZE_MAX;
+}
+
+/* Reduce a point into the current run, or close the run and start a new one.
+   Within a run the reducer's own policy picks the held point, so ties keep
+   the first point exactly as the in-place update does. A point the policy
+   cannot order (NaN) would not reduce the same way, so it bypasses the run. */
+static inline void run_add(ReducerKind red, const Binner *b, Layer *l, size_t idx,
+                           double z, double key, ZTok tok) {
+    RunAcc *r = &l->run;
+    if (idx == r->idx) {
+        ++r->len;
+        if (red_takes(red, true, r->z, r->key, z, key)) {
+            r->z = z;
+            r->key = key;
+            r->tok = tok;
+        }
+        return;
+    }
+    run_flush(red, b, l);
+    if (red_unordered(red, z, key)) {
+        engine_apply(red, b, l, idx, z, key, tok);
+        return;
+    }
+    r->idx = idx;
+    r->z = z;
+    r->key = key;
+    r->tok = tok;
+    r->len = 1;
+}
+
+/* --reducer mode. Every point is appended to a log; after ingest the log is
+   sorted by cell, value and input order, and each cell takes its longest run
+   of equal values (the first such run, so ties go to the smallest value, NaN
+   last). --tclfmt prints the token of the first point with that value. */
+static inline void mode_push(ModeLog *ml, const Grid *g, size_t idx, double z, ZTok tok) {
+    if (ml->n == ml->cap) {
+        ml->cap = ml->cap ? 2 * ml->cap : (size_t)1 << 16;
+        ModeRec *nr = (ModeRec*)realloc(ml->rec, safe_mul_size_t(ml->cap, sizeof(ModeRec)));
+        if (!nr) die("Out of memory logging points for --reducer mode");
+        ml->rec = nr;
+    }
+    ModeRec *r = &ml->rec[ml->n];
+    r->idx = idx;
+    r->z = z;
+    r->seq = ml->n++;
+    r->tok = g->grid_tok ? ztok_keep(tok) : (ZTok){0, 0};
+}
+
+static inline bool mode_same(double a, double b) {
+    return a == b || (a != a && b != b);
+}
+
+static int cmp_mode_rec(const void *pa, const void *pb) {
+    const ModeRec *a = (const ModeRec*)pa, *b = (const ModeRec*)pb;
+    if (a->idx != b->idx) return a->idx < b->idx ? -1 : 1;
+    if (!mode_same(a->z, b->z)) {
+        if (a->z != a->z) return 1;
+        if (b->z != b->z) return -1;
+        return a->z < b->z ? -1 : 1;
+    }
+    return (a->seq > b->seq) - (a->seq < b->seq);
+}
+
+static void mode_finish(ModeLog *ml, Grid *g) {
+    ModeRec *r = ml->rec;
+    const size_t n = ml->n;
+    qsort(r, n, sizeof(ModeRec), cmp_mode_rec);
+    for (size_t i = 0; i < n; ) {
+        const size_t idx = r[i].idx;
+        size_t best = i, best_len = 0, j = i;
+        while (j < n && r[j].idx == idx) {
+            size_t k = j + 1;
+            while (k < n && r[k].idx == idx && mode_same(r[k].z, r[j].z)) ++k;
+            if (k - j > best_len) { best = j; best_len = k - j; }
+            j = k;
+        }
+        g->grid[idx] = r[best].z;
+        g->hit[idx] = 1;
+        if (g->grid_tok) {
+            g->grid_tok[idx] = r[best].tok;
+            r[best].tok = (ZTok){0, 0};
+        }
+        for (; i < j; ++i) ztok_free(r[i].tok);
+    }
+    free(ml->rec);
+    memset(ml, 0, sizeof(*ml));
+}
+
+/* Apply any buffered updates to the grids. */
+static void binner_flush(Binner *b) {
+    for (size_t k = 0; k < b->nlayer; ++k) {
+        Layer *l = b->layer[k];
+        if (!l) continue;
+        run_flush(b->shape->red, b, l);
+        if (b->engine == ENGINE_SORT) sort_flush(&l->sort, &l->g);
+        else if (l->batch.n) batch_apply(&l->batch, &l->g);
+    }
+}
+
+static void layer_prepare(const Binner *b, Layer *l);
+
+static Layer *layer_new(Binner *b, double group) {
+    Layer *l = (Layer*)calloc(1, sizeof(Layer));
+    if (!l) die("Out of memory allocating layer");
+    grid_init(&l->g, b->opt, b->shape->nx, b->shape->ny);
+    l->run.idx = SIZE_MAX;
+    l->group = group;
+    layer_prepare(b, l);
+    return l;
+}
+
+static void layer_free(Layer *l) {
+    if (!l) return;
+    sort_free(&l->sort);
+    grid_free(&l->g);
+    free(l);
+}
+
+/* Start of input column col (3 or more), from zp at column 3; NULL when the
+   line has fewer columns. */
+static inline const char *field_at(const char *zp, int col) {
+    const char *p = zp;
+    for (int c = 3; c < col; ++c) {
+        while (*p && *p != '\n' && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\v' && *p != '\f') ++p;
+        p = skip_field_blanks(p);
+        if (*p == '\n' || *p == '\0') return NULL;
+    }
+    return p;
+}
+
+/* The --zcols values of a line (just z by default). A missing or
+   unreadable value makes the line malformed. */
+static inline bool scan_values(const Options *opt, const char *zp, double *z, ZTok *tok) {
+    if (opt->nband == 1 && opt->zcol[0] == 3) return ztok_scan(zp, z, tok);
+    for (size_t k = 0; k < opt->nband; ++k) {
+        const char *p = field_at(zp, opt->zcol[k]);
+        if (!p || !ztok_scan(p, &z[k], &tok[k])) return false;
+    }
+    return true;
+}
+
+/* --groupby: the value in the group column. A missing or unreadable value
+   makes the line malformed. */
+static inline bool group_value(const Options *opt, const char *zp, double *v) {
+    const char *p = field_at(zp, opt->group_col);
+    if (!p) return false;
+    char *end = NULL;
+    errno = 0; *v = strtod(p, &end);
+    return !errno && end != p && *v == *v;
+}
+
+/* --groupby: the band layers for group value v, created on first use.
+   Ranges are tried in the order given; a value in none of them is filtered
+   out. Without ranges the previous point's group is tried first, as points
+   of one group tend to arrive together, then the others in order of
+   appearance. */
+static Layer **group_layers(Binner *b, double v) {
+    const Options *opt = b->opt;
+    const size_t nb = opt->nband, ngroup = b->nlayer / nb;
+    size_t k = 0;
+    if (opt->ngroup) {
+        while (k < opt->ngroup && !(v >= opt->group_lo[k] && v <= opt->group_hi[k])) ++k;
+        if (k == opt->ngroup) { ++b->cnt.filtered; return NULL; }
+        if (!b->layer[k * nb])
+            for (size_t j = 0; j < nb; ++j) b->layer[k * nb + j] = layer_new(b, (double)k);
+        return &b->layer[k * nb];
+    }
+    if (ngroup && b->layer[b->last * nb]->group == v) return &b->layer[b->last * nb];
+    while (k < ngroup && b->layer[k * nb]->group != v) ++k;
+    if (k == ngroup) {
+        if (k == GROUP_MAX) {
+            fprintf(stderr, "--groupby: more than %d distinct values in column %d; give ranges instead\n",
+                    GROUP_MAX, opt->group_col);
+            exit(EXIT_FAILURE);
+        }
+        for (size_t j = 0; j < nb; ++j) b->layer[b->nlayer++] = layer_new(b, v);
+    }
+    b->last = k;
+    return &b->layer[k * nb];
+}
+
+/* Ingest filters on x/y, evaluated before z is parsed: the --clip box, the
+   cell mapping (--gmtbin drops points outside -R) and the --mask bit of the
+   cell. Returns false, with the point counted, when it is rejected. */
+static inline bool admit_xy(Binner *b, double x, double y, size_t *ix, size_t *iy) {
+    const Options *opt = b->opt;
+    const Grid *g = b->shape;
+    if (opt->clip && !(x >= opt->cxmin && x <= opt->cxmax && y >= opt->cymin && y <= opt->cymax)) {
+        ++b->cnt.filtered;
+        return false;
+    }
+    if (!map_cell(opt, g->nx, g->ny, x, y, ix, iy)) { ++b->cnt.dropped; return false; }
+    if (b->mask) {
+        const size_t idx = *ix + g->nx * *iy;
+        if (!(b->mask[idx >> 6] >> (idx & 63) & 1)) { ++b->cnt.filtered; return false; }
+    }
+    return true;
+}
+
+/* -Z: NaN is outside every range. */
+static inline bool admit_z(Binner *b, double z) {
+    if (b->opt->zfilter && !(z >= b->opt->zmin && z <= b->opt->zmax)) {
+        ++b->cnt.filtered;
+        return false;
+    }
+    return true;
+}
+
+/* Reduce a point into each band layer l[k] with value z[k]; the cell index
+   and the nearest-node distance are computed once. */
+static inline void bin_cell(ReducerKind red, Binner *b, Layer *const *l, size_t nb,
+                            size_t ix, size_t iy, double x, double y, const double *z,
+                            const ZTok *tok) {
+    const size_t idx = ix + b->shape->nx * iy;
+    double key = 0.0;
+    if (red == RED_NEAREST) {
+        double gx, gy;
+        cell_node(b->opt, ix, iy, &gx, &gy);
+        key = (x - gx) * (x - gx) + (y - gy) * (y - gy);
+    }
+    for (size_t k = 0; k < nb; ++k) {
+        if (red == RED_MODE) mode_push(&l[k]->mode, &l[k]->g, idx, z[k], tok[k]);
+        else if (b->runs) run_add(red, b, l[k], idx, z[k], key, tok[k]);
+        else engine_apply(red, b, l[k], idx, z[k], key, tok[k]);
+        ++l[k]->points;
+    }
+
+    ++b->lines;
+    if (b->snap && (b->lines & 0xFFFF) == 0) snapshot_poll(b);
+    if (b->lines == 1000000) {
+        ++b->Mlines;
+        fprintf(stderr, "%zu,000,000 lines\n", b->Mlines);
+        b->lines = 0;
+    }
+}
+
+static inline void bin_span_body(ReducerKind red, Binner *b, const char *data, size_t len) {
+    const char *end = data + len;
+    const bool grouped = b->opt->group_col > 0;
+    Layer *const *const single = grouped ? NULL : b->layer;
+    const size_t nb = b->opt->nband;
+    for (const char *line = data; line < end; ) {
+        const char *p = line;
+        line = next_line(line, end);
+        if (skip_blank(&p)) continue;
+
+        double x, y, z[BAND_MAX];
+        const char *zp;
+        ZTok tok[BAND_MAX];
+        size_t ix, iy;
+        if (!parse_xy(p, &x, &y, &zp)) { ++b->cnt.malformed; continue; }
+        if (!admit_xy(b, x, y, &ix, &iy)) { ++b->cnt.points; continue; }
+        if (!scan_values(b->opt, zp, z, tok)) { ++b->cnt.malformed; continue; }
+        double gv = 0.0;
+        if (grouped && !group_value(b->opt, zp, &gv)) { ++b->cnt.malformed; continue; }
+        ++b->cnt.points;
+        if (!admit_z(b, z[0])) continue;
+        Layer *const *l = grouped ? group_layers(b, gv) : single;
+        /* Constant band count for the common case, so the loop folds away. */
+        if (!l) continue;
+        if (nb == 1) bin_cell(red, b, l, 1, ix, iy, x, y, z, tok);
+        else bin_cell(red, b, l, nb, ix, iy, x, y, z, tok);
+    }
+    /* Buffered text tokens point into the span, which the caller is about to reuse. */
+    if (b->opt->tcl_fmt && red != RED_SUM) binner_flush(b);
+}
+
+/* Parse and bin a span of lines; one kernel per reducer. */
+#define X(N, n) \
+    HOT_KERNEL static void bin_span_##n(Binner *b, const char *data, size_t len) { \
+        bin_span_body(RED_##N, b, data, len); \
+    }
+REDUCERS(X)
+#undef X
+
+static void qt_span(Binner *b, const char *data, size_t len);
+
+static void bin_span(Binner *b, const char *data, size_t len) {
+    if (b->qt) { qt_span(b, data, len); return; }
+    switch (b->shape->red) {
+#define X(N, n) case RED_##N: bin_span_##n(b, data, len); break;
+    REDUCERS(X)
+#undef X
+    }
+}
+
+/* ------------------------------------------------------------------------ */
+/* Adaptive quadtree (--quadtree)                                            */
+/* ------------------------------------------------------------------------ */
+
+/* The grid is tiled with root blocks of 2^levels x 2^levels cells, created
+   on first use. A leaf larger than one cell keeps its points (cell and z) in
+   a bucket of N slots; the point that would be its N+1st splits it into four
+   children and the bucket's points move down. A one-cell leaf keeps only
+   its min and max. A block is therefore split exactly when more than N
+   points fall in it, whatever the input order: dense areas end at -I and
+   sparse areas stay as large blocks, and memory follows the points. Every
+   node keeps the min and max below it. Nodes and buckets live in two
+   pooled arenas addressed by 32-bit index, and the buckets of split leaves
+   are reused. */
+
+#define QT_NONE UINT32_MAX
+
+typedef struct {
+    double zmin, zmax;        /* over the points below; zmin > zmax: none yet */
+    uint32_t child;           /* first of the four children; 0: leaf */
+    uint32_t bucket;          /* QT_NONE, or the bucket of the leaf's points */
+    uint32_t count;           /* points in the bucket */
+} QNode;
+
+typedef struct {
+    uint32_t ix, iy;
+    double z;
+} QPoint;
+
+struct Quadtree {
+    unsigned levels;
+    uint32_t split;           /* bucket slots */
+    size_t nx, ny;            /* grid cells; edge blocks are clipped to them */
+    size_t rnx, rny;          /* root blocks across and down */
+    uint32_t *root;           /* node of each root block; 0: none yet */
+    QNode *node;              /* node 0 is unused */
+    size_t nnode, node_cap;
+    QPoint *pt;               /* buckets of split points each */
+    size_t nbucket, bucket_cap;
+    uint32_t free_bucket;     /* reusable buckets, chained through pt[].ix */
+};
+
+static Quadtree *qt_new(const Options *opt, const Grid *shape) {
+    if (shape->nx >= QT_NONE || shape->ny >= QT_NONE) die("Grid too large for --quadtree");
+    Quadtree *q = (Quadtree*)calloc(1, sizeof(Quadtree));
+    if (!q) die("Out of memory in --quadtree");
+    q->levels = opt->qt_levels;
+    q->split = opt->qt_split;
+    const size_t w = (size_t)1 << q->levels;
+    q->nx = shape->nx;
+    q->ny = shape->ny;
+    q->rnx = (shape->nx + w - 1) / w;
+    q->rny = (shape->ny + w - 1) / w;
+    q->root = (uint32_t*)calloc(safe_mul_size_t(q->rnx, q->rny), sizeof(uint32_t));
+    if (!q->root) die("Out of memory in --quadtree");
+    q->nnode = 1;
+    q->free_bucket = QT_NONE;
+    return q;
+}
+
+static void qt_free(Quadtree *q) {
+    if (!q) return;
+    free(q->root);
+    free(q->node);
+    free(q->pt);
+    free(q);
+}
+
+/* Append n empty leaves; returns the first. Invalidates QNode pointers. */
+static uint32_t qt_nodes(Quadtree *q, size_t n) {
+    if (q->nnode + n > q->node_cap) {
+        size_t cap = q->node_cap ? 2 * q->node_cap : 4096;
+        if (cap >= QT_NONE) die("Too many --quadtree nodes");
+        q->node = (QNode*)realloc(q->node, cap * sizeof(QNode));
+        if (!q->node) die("Out of memory in --quadtree");
+        q->node_cap = cap;
+    }
+    const uint32_t first = (uint32_t)q->nnode;
+    for (size_t i = 0; i < n; ++i)
+        q->node[first + i] = (QNode){ INFINITY, -INFINITY, 0, QT_NONE, 0 };
+    q->nnode += n;
+    return first;
+}
+
+static uint32_t qt_bucket(Quadtree *q) {
+    if (q->free_bucket != QT_NONE) {
+        const uint32_t k = q->free_bucket;
+        q->free_bucket = q->pt[(size_t)k * q->split].ix;
+        return k;
+    }
+    if (q->nbucket == q->bucket_cap) {
+        size_t cap = q->bucket_cap ? 2 * q->bucket_cap : 256;
+        if (cap >= QT_NONE) die("Too many --quadtree buckets");
+        q->pt = (QPoint*)realloc(q->pt, safe_mul_size_t(safe_mul_size_t(cap, q->split), sizeof(QPoint)));
+        if (!q->pt) die("Out of memory in --quadtree");
+        q->bucket_cap = cap;
+    }
+    return (uint32_t)q->nbucket++;
+}
+
+/* Child of a node of 2^(lg + 1) cells that holds cell (ix, iy). */
+static inline uint32_t qt_child(const QNode *nd, unsigned lg, uint32_t ix, uint32_t iy) {
+    return nd->child + (((iy >> lg) & 1u) << 1 | ((ix >> lg) & 1u));
+}
+
+/* Add a point below node n, a block of 2^lg cells. */
+static void qt_insert(Quadtree *q, uint32_t n, unsigned lg, uint32_t ix, uint32_t iy, double z) {
+    for (;;) {
+        QNode *nd = &q->node[n];
+        if (z < nd->zmin) nd->zmin = z;
+        if (z > nd->zmax) nd->zmax = z;
+        if (nd->child) { n = qt_child(nd, --lg, ix, iy); continue; }
+        if (lg == 0) return;
+        if (nd->bucket == QT_NONE) nd->bucket = qt_bucket(q);
+        if (nd->count < q->split) {
+            q->pt[(size_t)nd->bucket * q->split + nd->count++] = (QPoint){ ix, iy, z };
+            return;
+        }
+        /* Split: the children are leaves, and none gets more than split
+           points from the bucket, so moving them down splits nothing. */
+        const uint32_t bk = nd->bucket, c = qt_nodes(q, 4);
+        nd = &q->node[n];
+        nd->child = c;
+        nd->bucket = QT_NONE;
+        nd->count = 0;
+        --lg;
+        for (uint32_t i = 0; i < q->split; ++i) {
+            const QPoint p = q->pt[(size_t)bk * q->split + i];
+            qt_insert(q, qt_child(&q->node[n], lg, p.ix, p.iy), lg, p.ix, p.iy, p.z);
+        }
+        q->pt[(size_t)bk * q->split].ix = q->free_bucket;
+        q->free_bucket = bk;
+        n = qt_child(&q->node[n], lg, ix, iy);
+    }
+}
+
+static inline void qt_add(Quadtree *q, size_t ix, size_t iy, double z) {
+    uint32_t *r = &q->root[(iy >> q->levels) * q->rnx + (ix >> q->levels)];
+    if (!*r) *r = qt_nodes(q, 1);
+    qt_insert(q, *r, q->levels, (uint32_t)ix, (uint32_t)iy, z);
+}
+
+HOT_KERNEL
+static void qt_span(Binner *b, const char *data, size_t len) {
+    const char *end = data + len;
+    for (const char *line = data; line < end; ) {
+        const char *p = line;
+        line = next_line(line, end);
+        if (skip_blank(&p)) continue;
+
+        double x, y, z;
+        const char *zp;
+        ZTok tok;
+        size_t ix, iy;
+        if (!parse_xy(p, &x, &y, &zp)) { ++b->cnt.malformed; continue; }
+        if (!admit_xy(b, x, y, &ix, &iy)) { ++b->cnt.points; continue; }
+        if (!scan_values(b->opt, zp, &z, &tok)) { ++b->cnt.malformed; continue; }
+        ++b->cnt.points;
+        if (!admit_z(b, z)) continue;
+        qt_add(b->qt, ix, iy, z);
+
+        if (++b->lines == 1000000) {
+            ++b->Mlines;
+            fprintf(stderr, "%zu,000,000 lines\n", b->Mlines);
+            b->lines = 0;
+        }
+    }
+}
+
+/* Write the leaves below node n (a block of 2^lg cells from cell x0, y0)
+   as "xc yc z width height"; returns how many. Root blocks on the right and
+   top rows may reach past the grid, so each block is clipped to it: the
+   centre and extent are those of the cells it actually covers. */
+static size_t qt_write_node(const Options *opt, const Quadtree *q, uint32_t n, unsigned lg,
+                            size_t x0, size_t y0, FILE *fout) {
+    const QNode *nd = &q->node[n];
+    if (nd->child) {
+        const size_t h = (size_t)1 << (lg - 1);
+        size_t k = 0;
+        for (uint32_t c = 0; c < 4; ++c)
+            k += qt_write_node(opt, q, nd->child + c, lg - 1, x0 + (c & 1u) * h, y0 + (c >> 1) * h, fout);
+        return k;
+    }
+    if (!(nd->zmin <= nd->zmax)) return 0;
+    const size_t w = (size_t)1 << lg;
+    const size_t wx = w < q->nx - x0 ? w : q->nx - x0;
+    const size_t wy = w < q->ny - y0 ? w : q->ny - y0;
+    double ax, ay, bx, by;
+    cell_node(opt, x0, y0, &ax, &ay);
+    cell_node(opt, x0 + wx - 1, y0 + wy - 1, &bx, &by);
+    fprintf(fout, "%.10g %.10g %.10g %.10g %.10g\n", 0.5 * (ax + bx), 0.5 * (ay + by),
+            opt->reducer == RED_MAX ? nd->zmax : nd->zmin, (double)wx * opt->inc,
+            (double)wy * opt->inc);
+    return 1;
+}
+
+/* Write every leaf that received points, root block by root block in row
+   order; returns how many. */
+static size_t qt_write(const Options *opt, const Quadtree *q, FILE *fout) {
+    size_t k = 0;
+    for (size_t ry = 0; ry < q->rny; ++ry)
+        for (size_t rx = 0; rx < q->rnx; ++rx) {
+            const uint32_t r = q->root[ry * q->rnx + rx];
+            if (r) k += qt_write_node(opt, q, r, q->levels, rx << q->levels, ry << q->levels, fout);
+        }
+    return k;
+}
+
+/* ------------------------------------------------------------------------ */
+/* Engine selection                                                          */
+/* ------------------------------------------------------------------------ */
+
+static int cmp_size_t(const void *a, const void *b) {
+    const size_t x = *(const size_t*)a, y = *(const size_t*)b;
+    return (x > y) - (x < y);
+}
+
+/* Points sampled from the pre-scan cache when the text is not re-read. */
+#define PROFILE_POINTS ((size_t)1 << 17)
+
+static void profile_add(Profile *pr, size_t nx, size_t ix, size_t iy) {
+    if (pr->points) {
+        const size_t dx = ix > pr->pix ? ix - pr->pix : pr->pix - ix;
+        const size_t dy = iy > pr->piy ? iy - pr->piy : pr->piy - iy;
+        if (dx == 0 && dy == 0) ++pr->same;
+        else if (dx <= 1 && dy <= 1) ++pr->neighbour;
+    }
+    pr->pix = ix;
+    pr->piy = iy;
+    if (pr->points == pr->cap) {
+        pr->cap = pr->cap ? 2 * pr->cap : (size_t)1 << 16;
+        size_t *nc = (size_t*)realloc(pr->cells, pr->cap * sizeof(size_t));
+        if (!nc) die("Out of memory profiling input");
+        pr->cells = nc;
+    }
+    pr->cells[pr->points++] = ix + nx * iy;
+}
+
+static void profile_finish(Profile *pr) {
+    qsort(pr->cells, pr->points, sizeof(size_t), cmp_size_t);
+    for (size_t i = 0; i < pr->points; ++i)
+        if (i == 0 || pr->cells[i] != pr->cells[i-1]) ++pr->distinct;
+    free(pr->cells);
+    pr->cells = NULL;
+}
+
+/* Measure locality and occupancy of a span without touching the grid. */
+static void profile_span(const Options *opt, const Grid *g, const char *data, size_t len, Profile *pr) {
+    memset(pr, 0, sizeof(*pr));
+    pr->bytes = len;
+    const char *end = data + len;
+    for (const char *line = data; line < end; ) {
+        const char *p = line;
+        line = next_line(line, end);
+        if (skip_blank(&p)) continue;
+        double x, y, z;
+        ZTok tok;
+        size_t ix, iy;
+        if (!parse_xyz(p, &x, &y, &z, &tok)) continue;
+        if (!map_cell(opt, g->nx, g->ny, x, y, &ix, &iy)) continue;
+        profile_add(pr, g->nx, ix, iy);
+    }
+    profile_finish(pr);
+}
+
+static size_t grid_bytes(const Options *opt, size_t ncell) {
+    size_t per_cell = sizeof(double) + 1;
+    if (opt->tcl_fmt && opt->reducer != RED_SUM) per_cell += sizeof(ZTok);
+    if (opt->reducer == RED_NEAREST) per_cell += sizeof(double);
+    return safe_mul_size_t(ncell, per_cell);
+}
+
+/* Grids larger than this are assumed not to fit in the last-level cache. */
+#define CACHE_BYTES ((size_t)32 << 20)
+
+/* Without --engine: sort for grids of at least --sort-above bytes. */
+static void default_engine(Binner *b) {
+    const size_t gbytes = grid_bytes(b->opt, b->shape->ncell);
+    const bool big = (double)gbytes >= b->opt->sort_above;
+    b->engine = big ? ENGINE_SORT : ENGINE_DENSE;
+    snprintf(b->reason, sizeof(b->reason), "grid %.1f MiB %s --sort-above %.0f MiB",
+             (double)gbytes / 1048576.0, big ? "at or above" : "below",
+             b->opt->sort_above / 1048576.0);
+}
+
+static void choose_engine(Binner *b) {
+    const Profile *pr = &b->prof;
+    const size_t gbytes = grid_bytes(b->opt, b->shape->ncell);
+    const double mib = (double)gbytes / 1048576.0;
+    const double pairs = pr->points > 1 ? (double)(pr->points - 1) : 1.0;
+    const double same = (double)pr->same / pairs;
+    const double near = (double)(pr->same + pr->neighbour) / pairs;
+
+    if ((double)gbytes >= b->opt->sort_above) {
+        b->engine = ENGINE_SORT;
+        snprintf(b->reason, sizeof(b->reason),
+                 "grid %.1f MiB at or above --sort-above: partitioned updates", mib);
+    } else if (gbytes > CACHE_BYTES && near < 0.8) {
+        b->engine = ENGINE_SORT;
+        snprintf(b->reason, sizeof(b->reason),
+                 "grid %.1f MiB exceeds cache and only %.0f%% of steps stay within a cell "
+                 "or its neighbours: partitioned updates", mib, 100.0 * near);
+    } else {
+        b->engine = ENGINE_DENSE;
+        snprintf(b->reason, sizeof(b->reason),
+                 "grid %.1f MiB, %.0f%% near-cell locality: dense in-place updates",
+                 mib, 100.0 * near);
+    }
+
+    /* A run check that rarely hits only adds a compare and a copy per point. */
+    if (b->runs && same < 0.25) {
+        b->runs = false;
+        size_t n = strlen(b->reason);
+        snprintf(b->reason + n, sizeof(b->reason) - n,
+                 "; %.0f%% same-cell steps: run fast path off", 100.0 * same);
+    } else if (b->runs) {
+        size_t n = strlen(b->reason);
+        snprintf(b->reason + n, sizeof(b->reason) - n,
+                 "; %.0f%% same-cell steps: run fast path on", 100.0 * same);
+    }
+}
+
+static const char *engine_name(EngineKind e);
+
+/* Set up a layer's buffers for the chosen engine. */
+static void layer_prepare(const Binner *b, Layer *l) {
+    const Grid *g = b->shape;
+    if (b->engine == ENGINE_SORT && !l->sort.rec) sort_init(&l->sort, g->ncell);
+    if (b->opt->prefetch >= 0) l->batch.dist = (unsigned)b->opt->prefetch;
+    else l->batch.dist = grid_bytes(b->opt, g->ncell) > CACHE_BYTES ? PREFETCH_DEFAULT : 0;
+    l->batch.simd = b->engine == ENGINE_DENSE && !b->opt->no_simd &&
+                    (g->red == RED_MIN || g->red == RED_MAX) && cpu_has_avx512();
+    l->batch.on = l->batch.dist > 0 || l->batch.simd;
+}
+
+/* Resolve --engine auto from b->prof. */
+static void engine_prepare(Binner *b) {
+    for (size_t k = 0; k < b->nlayer; ++k)
+        if (b->layer[k]) layer_prepare(b, b->layer[k]);
+}
+
+static void engine_from_profile(Binner *b) {
+    b->profiled = true;
+    choose_engine(b);
+    engine_prepare(b);
+    fprintf(stderr, "engine %s: %s\n", engine_name(b->engine), b->reason);
+}
+
+static const char *engine_name(EngineKind e) {
+    switch (e) {
+    case ENGINE_DEFAULT: return "default";
+    case ENGINE_AUTO:    return "auto";
+    case ENGINE_DENSE:   return "dense";
+    case ENGINE_SORT:    return "sort";
+    }
+    return "?";
+}
+
+/* Name of the ISA level the HOT_KERNEL clones dispatch to on this CPU. */
+static const char *isa_level(void) {
+#if defined(HAVE_X86_SIMD) && defined(__linux__) && !defined(__clang__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("x86-64-v4")) return "x86-64-v4 (AVX-512)";
+    if (__builtin_cpu_supports("x86-64-v3")) return "x86-64-v3 (AVX2)";
+    if (__builtin_cpu_supports("x86-64-v2")) return "x86-64-v2 (SSE4.2)";
+    return "x86-64 baseline";
+#else
+    return "build target (no runtime dispatch)";
+#endif
+}
+
+static void print_stats(const Binner *b, const char *input) {
+    const Grid *g = b->shape;
+    const Layer *l0 = NULL;
+    size_t occupied = 0, nl = 0;
+    unsigned long long hist[RUN_HIST] = {0}, flushes = 0;
+    for (size_t k = 0; k < b->nlayer; ++k) {
+        const Layer *l = b->layer[k];
+        if (!l) continue;
+        if (!l0) l0 = l;
+        /* Every band of a group holds the same cells. */
+        if (k % b->opt->nband == 0) {
+            ++nl;
+            for (size_t i = 0; i < g->ncell; ++i) occupied += l->g.hit[i] != 0;
+        }
+        for (int h = 0; h < RUN_HIST; ++h) hist[h] += l->run.hist[h];
+        flushes += l->sort.flushes;
+    }
+    fprintf(stderr, "stats: input %s\n", input);
+    fprintf(stderr, "stats: kernels %s\n", isa_level());
+    fprintf(stderr, "stats: points %llu, dropped %llu, filtered %llu, malformed %llu\n",
+            b->cnt.points, b->cnt.dropped, b->cnt.filtered, b->cnt.malformed);
+    if (b->qt) {
+        fprintf(stderr, "stats: quadtree %zu root blocks, %zu nodes, %zu buckets\n",
+                b->qt->rnx * b->qt->rny, b->qt->nnode - 1, b->qt->nbucket);
+    } else if (b->opt->group_col) {
+        fprintf(stderr, "stats: groups %zu by column %d, cells %zu per group, occupied %zu in all\n",
+                nl, b->opt->group_col, g->ncell, occupied);
+    } else {
+        fprintf(stderr, "stats: cells %zu, occupied %zu (%.2f%%)\n",
+                g->ncell, occupied, g->ncell ? 100.0 * (double)occupied / (double)g->ncell : 0.0);
+    }
+    if (b->opt->preview)
+        fprintf(stderr, "stats: preview 1 in %u chunks, %llu of %llu bytes (%.2f%%)\n",
+                b->opt->preview, b->sampled_bytes, b->input_bytes,
+                b->input_bytes ? 100.0 * (double)b->sampled_bytes / (double)b->input_bytes : 0.0);
+    fprintf(stderr, "stats: reducer %s", reducer_names[g->red]);
+    if (b->opt->nband > 1) {
+        fprintf(stderr, " on columns");
+        for (size_t k = 0; k < b->opt->nband; ++k) fprintf(stderr, "%s%d", k ? "," : " ", b->opt->zcol[k]);
+    }
+    fprintf(stderr, "\n");
+    if (b->qt) return;
+    fprintf(stderr, "stats: engine %s (%s)\n", engine_name(b->engine), b->reason);
+    if (b->runs) {
+        unsigned long long runs = 0;
+        for (int k = 0; k < RUN_HIST; ++k) runs += hist[k];
+        fprintf(stderr, "stats: same-cell runs %llu (%.2f points/run); length histogram:", runs,
+                runs ? (double)(b->cnt.points - b->cnt.dropped) / (double)runs : 0.0);
+        for (int k = 0; k < RUN_HIST; ++k) {
+            if (!hist[k]) continue;
+            if (k == 0) fprintf(stderr, " 1:%llu", hist[k]);
+            else if (k + 1 == RUN_HIST) fprintf(stderr, " >=%lu:%llu", 1ul << k, hist[k]);
+            else fprintf(stderr, " %lu-%lu:%llu", 1ul << k, (2ul << k) - 1, hist[k]);
+        }
+        fprintf(stderr, "\n");
+    }
+    if (b->engine == ENGINE_DENSE && l0)
+        fprintf(stderr, "stats: dense engine prefetch distance %u, %s\n", l0->batch.dist,
+                l0->batch.simd ? "AVX-512 conflict-detecting kernel (batches of " STR(BATCH_RECS) ")"
+                : l0->batch.on ? "scalar kernel (batches of " STR(BATCH_RECS) ")" : "scalar kernel (unbatched)");
+    if (b->engine == ENGINE_SORT && l0)
+        fprintf(stderr, "stats: sort engine %llu flushes of up to %zu records, %u-bit index, "
+                "%u-bit buckets\n", flushes, l0->sort.cap, l0->sort.top_bits, SORT_BUCKET_BITS);
+    if (b->profiled) {
+        const Profile *pr = &b->prof;
+        const double pairs = pr->points > 1 ? (double)(pr->points - 1) : 1.0;
+        fprintf(stderr, "stats: profile %zu bytes, %zu points, same cell %.1f%%, "
+                "neighbour cell %.1f%%, %zu distinct cells (%.1f points/cell)\n",
+                pr->bytes, pr->points, 100.0 * (double)pr->same / pairs,
+                100.0 * (double)pr->neighbour / pairs, pr->distinct,
+                pr->distinct ? (double)pr->points / (double)pr->distinct : 0.0);
+    }
+}
+
+/* ------------------------------------------------------------------------ */
+/* Region auto-detection (-Rauto)                                            */
+/* ------------------------------------------------------------------------ */
+
+/* The input is mapped and split into one byte range per thread; a line
+   belongs to the range its first byte falls in. Each thread parses its lines
+   for the x/y bounds and, while the cache budget allows, keeps the parsed
+   points so the binning pass can run without parsing the text again. */
+
+typedef struct {
+    double x, y, z;
+    ZTok tok;            /* z token; text points into the mapping or the part's tail copy */
+} CachedPoint;
+
+typedef struct {
+    const char *base;
+    size_t size;
+    size_t begin, end;
+    int fd;              /* --read-once: the input, to drop behind; -1 otherwise */
+    double xmin, xmax, ymin, ymax;
+    unsigned long long points, malformed;
+    CachedPoint *pts;
+    size_t n, cap, limit;
+    bool overflow;       /* cache budget exceeded; pts has been released */
+    char *tail;          /* NUL-terminated copy of an unterminated last line */
+} ScanPart;
+
+typedef struct {
+    char *base;
+    size_t size;
+    ScanPart *parts;
+    int nparts;
+    bool cached;         /* every part kept its points */
+} PreScan;
+
+static void prescan_line(ScanPart *sp, const char *p) {
+    if (skip_blank(&p)) return;
+    double x, y, z;
+    ZTok tok;
+    if (!parse_xyz(p, &x, &y, &z, &tok)) { ++sp->malformed; return; }
+    ++sp->points;
+    if (isfinite(x) && isfinite(y)) {
+        if (x < sp->xmin) sp->xmin = x;
+        if (x > sp->xmax) sp->xmax = x;
+        if (y < sp->ymin) sp->ymin = y;
+        if (y > sp->ymax) sp->ymax = y;
+    }
+    if (sp->overflow) return;
+    if (sp->n == sp->cap) {
+        if (sp->cap >= sp->limit) {
+            sp->overflow = true;
+            free(sp->pts);
+            sp->pts = NULL;
+            sp->n = sp->cap = 0;
+            return;
+        }
+        size_t cap = sp->cap ? 2 * sp->cap : (size_t)1 << 16;
+        if (cap > sp->limit) cap = sp->limit;
+        CachedPoint *np = (CachedPoint*)realloc(sp->pts, cap * sizeof(CachedPoint));
+        if (!np) {
+            sp->overflow = true;
+            free(sp->pts);
+            sp->pts = NULL;
+            sp->n = sp->cap = 0;
+            return;
+        }
+        sp->pts = np;
+        sp->cap = cap;
+    }
+    CachedPoint *cp = &sp->pts[sp->n++];
+    cp->x = x; cp->y = y; cp->z = z;
+    cp->tok = tok;
+}
+
+HOT_KERNEL
+static void *prescan_part(void *arg) {
+    ScanPart *sp = (ScanPart*)arg;
+    const char *base = sp->base;
+    size_t pos = sp->begin, dropped = sp->begin / IO_ALIGN * IO_ALIGN;
+    if (pos > 0 && base[pos-1] != '\n') {
+        const char *nl = memchr(base + pos, '\n', sp->size - pos);
+        pos = nl ? (size_t)(nl - base) + 1 : sp->size;
+    }
+    while (pos < sp->end) {
+        if (sp->fd >= 0 && pos - dropped >= READ_DROP) {
+            /* Unmap the pages parsed so far, then release them from the
+               cache (mapped pages would be kept). Cached text tokens that
+               point into them fault back in from the file. */
+            const size_t to = pos / IO_ALIGN * IO_ALIGN;
+            madvise((char*)base + dropped, to - dropped, MADV_DONTNEED);
+            input_drop(sp->fd, dropped, to);
+            dropped = to;
+        }
+        const char *p = base + pos;
+        const char *nl = memchr(p, '\n', sp->size - pos);
+        if (!nl) {
+            /* The mapping has no terminator after the last line; parse a copy. */
+            size_t n = sp->size - pos;
+            sp->tail = (char*)malloc(n + 1);
+            if (!sp->tail) die("Out of memory in pre-scan");
+            memcpy(sp->tail, p, n);
+            sp->tail[n] = '\0';
+            prescan_line(sp, sp->tail);
+            break;
+        }
+        prescan_line(sp, p);
+        pos = (size_t)(nl - base) + 1;
+    }
+    if (sp->fd >= 0 && pos > dropped) {
+        madvise((char*)base + dropped, pos - dropped, MADV_DONTNEED);
+        input_drop(sp->fd, dropped, pos);
+    }
+    return NULL;
+}
+
+static void prescan_run(const Options *opt, PreScan *ps) {
+    memset(ps, 0, sizeof(*ps));
+    int fd = open(opt->path, O_RDONLY);
+    if (fd < 0) die_perror("Failed to open input file");
+    struct stat st;
+    if (fstat(fd, &st) != 0) die_perror("Failed to stat input file");
+    if (!S_ISREG(st.st_mode)) die("-Rauto requires a regular input file");
+    if (st.st_size == 0) die("-Rauto: input file is empty");
+    ps->size = (size_t)st.st_size;
+    void *m = mmap(NULL, ps->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (m == MAP_FAILED) die_perror("Failed to map input file");
+    if (opt->read_once) input_advise(fd);
+    ps->base = (char*)m;
+    madvise(ps->base, ps->size, MADV_SEQUENTIAL);
+
+    int nparts = opt->threads;
+    if ((size_t)nparts > ps->size / READ_CHUNK + 1) nparts = (int)(ps->size / READ_CHUNK + 1);
+    ps->nparts = nparts;
+    ps->parts = (ScanPart*)calloc((size_t)nparts, sizeof(ScanPart));
+    if (!ps->parts) die("Out of memory in pre-scan");
+
+    /* Keep parsed points within a quarter of physical memory. */
+    const long pages = sysconf(_SC_PHYS_PAGES);
+    const long psize = sysconf(_SC_PAGE_SIZE);
+    const double budget = (pages > 0 && psize > 0) ? 0.25 * (double)pages * (double)psize : 1073741824.0;
+    /* --groupby and --zcols need columns the cache does not keep, and
+       --quadtree bins through bin_span(): bounds only. */
+    const bool z_only = !opt->group_col && opt->nband == 1 && opt->zcol[0] == 3 && !opt->qt_split;
+    const size_t limit = z_only ? (size_t)(budget / (double)sizeof(CachedPoint) / nparts) : 0;
+
+    for (int i = 0; i < nparts; ++i) {
+        ScanPart *sp = &ps->parts[i];
+        sp->base = ps->base;
+        sp->size = ps->size;
+        sp->begin = ps->size / (size_t)nparts * (size_t)i;
+        sp->end = i + 1 == nparts ? ps->size : ps->size / (size_t)nparts * (size_t)(i + 1);
+        sp->xmin = sp->ymin = INFINITY;
+        sp->xmax = sp->ymax = -INFINITY;
+        sp->limit = limit;
+        sp->fd = opt->read_once ? fd : -1;
+    }
+    pthread_t *tid = (pthread_t*)calloc((size_t)nparts, sizeof(pthread_t));
+    if (!tid) die("Out of memory in pre-scan");
+    for (int i = 1; i < nparts; ++i)
+        if (pthread_create(&tid[i], NULL, prescan_part, &ps->parts[i]) != 0)
+            die("Failed to start pre-scan thread");
+    prescan_part(&ps->parts[0]);
+    for (int i = 1; i < nparts; ++i) pthread_join(tid[i], NULL);
+    free(tid);
+    close(fd);
+
+    ps->cached = true;
+    for (int i = 0; i < nparts; ++i) ps->cached = ps->cached && !ps->parts[i].overflow;
+    if (!ps->cached) {
+        for (int i = 0; i < nparts; ++i) {
+            free(ps->parts[i].pts);
+            ps->parts[i].pts = NULL;
+            ps->parts[i].n = 0;
+        }
+    }
+}
+
+/* Set the region in *opt from the pre-scan bounds. */
+static void prescan_region(const PreScan *ps, Options *opt) {
+    double xmin = INFINITY, xmax = -INFINITY, ymin = INFINITY, ymax = -INFINITY;
+    for (int i = 0; i < ps->nparts; ++i) {
+        const ScanPart *sp = &ps->parts[i];
+        if (sp->xmin < xmin) xmin = sp->xmin;
+        if (sp->xmax > xmax) xmax = sp->xmax;
+        if (sp->ymin < ymin) ymin = sp->ymin;
+        if (sp->ymax > ymax) ymax = sp->ymax;
+    }
+    if (!(xmin <= xmax && ymin <= ymax)) die("-Rauto: no valid points in input");
+    if (opt->clip) {
+        /* Points outside the --clip box are never binned. */
+        xmin = fmax(xmin, opt->cxmin); xmax = fmin(xmax, opt->cxmax);
+        ymin = fmax(ymin, opt->cymin); ymax = fmin(ymax, opt->cymax);
+        if (!(xmin <= xmax && ymin <= ymax)) die("-Rauto: no points inside --clip");
+    }
+    if (opt->region_snap) {
+        xmin = floor(xmin / opt->inc) * opt->inc;
+        xmax = ceil(xmax / opt->inc) * opt->inc;
+        ymin = floor(ymin / opt->inc) * opt->inc;
+        ymax = ceil(ymax / opt->inc) * opt->inc;
+    }
+    /* A single row or column of points still needs a non-empty region. */
+    if (!(xmax > xmin)) xmax = xmin + opt->inc;
+    if (!(ymax > ymin)) ymax = ymin + opt->inc;
+    opt->xmin = xmin; opt->xmax = xmax;
+    opt->ymin = ymin; opt->ymax = ymax;
+}
+
+/* Bin the cached points in input order; one kernel per reducer. The cache
+   holds x, y and z only, so --groupby and --zcols never use it (see
+   prescan_run()). */
+static inline void prescan_bin_body(ReducerKind red, const PreScan *ps, Binner *b) {
+    for (int i = 0; i < ps->nparts; ++i) {
+        const ScanPart *sp = &ps->parts[i];
+        b->cnt.malformed += sp->malformed;
+        for (size_t k = 0; k < sp->n; ++k) {
+            const CachedPoint *cp = &sp->pts[k];
+            size_t ix, iy;
+            ++b->cnt.points;
+            if (admit_xy(b, cp->x, cp->y, &ix, &iy) && admit_z(b, cp->z))
+                bin_cell(red, b, b->layer, 1, ix, iy, cp->x, cp->y, &cp->z, &cp->tok);
+        }
+    }
+}
+
+#define X(N, n) \
+    HOT_KERNEL static void prescan_bin_##n(const PreScan *ps, Binner *b) { \
+        prescan_bin_body(RED_##N, ps, b); \
+    }
+REDUCERS(X)
+#undef X
+
+static void prescan_bin(const PreScan *ps, Binner *b) {
+    switch (b->shape->red) {
+#define X(N, n) case RED_##N: prescan_bin_##n(ps, b); break;
+    REDUCERS(X)
+#undef X
+    }
+}
+
+static void prescan_profile(const PreScan *ps, const Options *opt, const Grid *g, Profile *pr) {
+    memset(pr, 0, sizeof(*pr));
+    for (int i = 0; i < ps->nparts && pr->points < PROFILE_POINTS; ++i) {
+        const ScanPart *sp = &ps->parts[i];
+        for (size_t k = 0; k < sp->n && pr->points < PROFILE_POINTS; ++k) {
+            size_t ix, iy;
+            if (map_cell(opt, g->nx, g->ny, sp->pts[k].x, sp->pts[k].y, &ix, &iy))
+                profile_add(pr, g->nx, ix, iy);
+        }
+    }
+    profile_finish(pr);
+}
+
+static void prescan_free(PreScan *ps) {
+    for (int i = 0; i < ps->nparts; ++i) {
+        free(ps->parts[i].pts);
+        free(ps->parts[i].tail);
+    }
+    free(ps->parts);
+    if (ps->base) munmap(ps->base, ps->size);
+    memset(ps, 0, sizeof(*ps));
+}
+
+/* ------------------------------------------------------------------------ */
+/* Quick-look sampling (--preview)                                           */
+/* ------------------------------------------------------------------------ */
+
+/* The input is divided into strata of N chunks and one READ_CHUNK range per
+   stratum is binned. A range takes every line that starts inside it, so the
+   line straddling its end is completed and a line cut by its start is left
+   to the previous range. Only the sampled ranges are read. */
+
+static size_t pread_full(int fd, char *buf, size_t len, off_t off) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = pread(fd, buf + got, len - got, off + (off_t)got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) die_perror("Failed to read input file");
+        if (n == 0) break;
+        got += (size_t)n;
+    }
+    return got;
+}
+
+static uint64_t xorshift64(uint64_t *s) {
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+static void preview_bin(Binner *b) {
+    const Options *opt = b->opt;
+    int fd = open(opt->path, O_RDONLY);
+    if (fd < 0) die_perror("Failed to open input file");
+    struct stat st;
+    if (fstat(fd, &st) != 0) die_perror("Failed to stat input file");
+    if (!S_ISREG(st.st_mode)) die("--preview requires a regular input file");
+    const size_t size = (size_t)st.st_size;
+    b->input_bytes = size;
+
+    const size_t stride = READ_CHUNK * opt->preview;
+    const size_t cap = 1 + READ_CHUNK + LINE_MAX_LEN;
+    char *buf = (char*)malloc(cap + 1);
+    if (!buf) die("Out of memory allocating read buffer");
+    uint64_t seed = 0x9E3779B97F4A7C15ull;
+    bool first = true;
+
+    for (size_t s0 = 0; s0 < size; s0 += stride) {
+        size_t off = s0;
+        if (opt->preview_random && stride > READ_CHUNK) {
+            size_t span = stride - READ_CHUNK;
+            if (span > size - s0) span = size - s0;
+            off += (size_t)(xorshift64(&seed) % span);
+        }
+        /* Read from one byte early: if that byte is a newline the range
+           starts exactly on a line. */
+        const size_t from = off ? off - 1 : 0;
+        const size_t n = pread_full(fd, buf, cap, (off_t)from);
+        if (n == 0) break;
+        if (opt->read_once) input_drop(fd, from, from + n);
+        buf[n] = '\0';
+        char *p = buf, *end = buf + n;
+        if (off) {
+            char *nl = memchr(buf, '\n', n);
+            if (!nl) continue;
+            p = nl + 1;
+        }
+        char *limit = buf + (off - from) + READ_CHUNK;
+        if (limit < end) {
+            /* End after the line that straddles the range end. */
+            char *nl = memchr(limit - 1, '\n', (size_t)(end - (limit - 1)));
+            if (nl) end = nl + 1;
+            else if (from + n < size) {
+                /* Overlong line: stop before it. */
+                while (end > p && end[-1] != '\n') --end;
+            }
+        }
+        if (p >= end) continue;
+
+        if (first && b->engine == ENGINE_AUTO) {
+            profile_span(opt, b->shape, p, (size_t)(end - p), &b->prof);
+            engine_from_profile(b);
+        }
+        first = false;
+        b->sampled_bytes += (unsigned long long)(end - p);
+        bin_span(b, p, (size_t)(end - p));
+    }
+    free(buf);
+    close(fd);
+}
+
+/* ------------------------------------------------------------------------ */
+/* Ingest driver                                                             */
+/* ------------------------------------------------------------------------ */
+
+/* Choose the engine and create the layers. --groupby layers are created as
+   their groups occur. */
+static void binner_init(Binner *b, const Options *opt, const Grid *shape) {
+    memset(b, 0, sizeof(*b));
+    b->opt = opt;
+    b->shape = shape;
+    b->engine = opt->engine;
+    snprintf(b->reason, sizeof(b->reason), "requested");
+    b->runs = !opt->no_runs && red_runs(opt->reducer);
+    if (b->engine == ENGINE_DEFAULT) default_engine(b);
+    if (opt->reducer == RED_MODE) {
+        b->engine = ENGINE_DENSE;
+        snprintf(b->reason, sizeof(b->reason), "reducer mode logs points and reduces them after ingest");
+    }
+    b->layer = (Layer**)calloc((opt->group_col ? GROUP_MAX : 1) * opt->nband, sizeof(Layer*));
+    if (!b->layer) die("Out of memory");
+    if (opt->qt_split) {
+        /* No grid, so nothing for an engine to choose. */
+        b->qt = qt_new(opt, shape);
+        b->engine = ENGINE_DENSE;
+        b->runs = false;
+        return;
+    }
+    b->nlayer = (opt->group_col ? opt->ngroup : 1) * opt->nband;
+    if (!opt->group_col)
+        for (size_t k = 0; k < opt->nband; ++k) b->layer[k] = layer_new(b, 0.0);
+}
+
+/* --seed: load a previous output (x y z rows) into the grid. Its cells get
+   hit = 3. The engines store hit = 1 only when a point takes a cell, so
+   after ingest hit == 1 marks exactly the cells this run changed or added,
+   at no extra cost per point. Returns the cells loaded. */
+static size_t seed_load(Binner *b, const char *path) {
+    Grid *g = &b->layer[0]->g;
+    Reader rd;
+    reader_open(&rd, path, b->opt->read_once);
+    char *data;
+    size_t len, n = 0, bad = 0;
+    while (reader_next(&rd, &data, &len)) {
+        const char *end = data + len;
+        for (const char *line = data; line < end; ) {
+            const char *p = line;
+            line = next_line(line, end);
+            if (skip_blank(&p)) continue;
+            double x, y, z;
+            ZTok tok;
+            size_t ix, iy;
+            if (!parse_xyz(p, &x, &y, &z, &tok) || !map_cell(b->opt, g->nx, g->ny, x, y, &ix, &iy)) {
+                ++bad;
+                continue;
+            }
+            const size_t idx = ix + g->nx * iy;
+            n += !g->hit[idx];
+            g->grid[idx] = z;
+            g->hit[idx] = 3;
+            if (g->grid_tok) ztok_store(&g->grid_tok[idx], tok);
+        }
+    }
+    reader_close(&rd);
+    if (bad) fprintf(stderr, "--seed: skipped %zu malformed or outside lines in %s\n", bad, path);
+    return n;
+}
+
+/* Stream an input in chunks. The first chunk doubles as the profile sample. */
+static void binner_stream(Binner *b, const char *path) {
+    Reader rd;
+    reader_open(&rd, path, b->opt->read_once);
+    char *data;
+    size_t len;
+    bool first = true;
+    while (reader_next(&rd, &data, &len)) {
+        if (first && b->engine == ENGINE_AUTO) {
+            profile_span(b->opt, b->shape, data, len, &b->prof);
+            engine_from_profile(b);
+        }
+        first = false;
+        bin_span(b, data, len);
+    }
+    reader_close(&rd);
+}
+
+/* Apply what is still buffered and reduce --reducer mode logs. */
+static void binner_finish(Binner *b) {
+    if (b->engine == ENGINE_AUTO) {
+        b->engine = ENGINE_DENSE;
+        snprintf(b->reason, sizeof(b->reason), "empty input");
+    }
+    binner_flush(b);
+    if (b->shape->red == RED_MODE)
+        for (size_t k = 0; k < b->nlayer; ++k)
+            if (b->layer[k]) mode_finish(&b->layer[k]->mode, &b->layer[k]->g);
+}
+
+static void binner_free(Binner *b) {
+    qt_free(b->qt);
+    for (size_t k = 0; k < b->nlayer; ++k) layer_free(b->layer[k]);
+    free(b->layer);
+    memset(b, 0, sizeof(*b));
+}
+
+/* ------------------------------------------------------------------------ */
+/* Difference of two inputs (--diff)                                         */
+/* ------------------------------------------------------------------------ */
+
+/* The second input gets its own Binner on the same grid shape and is
+   streamed on a second thread while the main thread bins the first, so the
+   two parse in parallel. Only the mask is shared, read-only. The grids are
+   then subtracted in place: the first grid becomes second - first where
+   both cells are occupied, and empty elsewhere. */
+
+static void *diff_ingest(void *arg) {
+    Binner *b = (Binner*)arg;
+    binner_stream(b, b->opt->diff);
+    binner_finish(b);
+    return NULL;
+}
+
+typedef struct {
+    size_t both, only_a, only_b;
+    double mean, m2, min, max, sumsq;
+} DiffStats;
+
+static void diff_grids(Grid *a, const Grid *b, DiffStats *st) {
+    memset(st, 0, sizeof(*st));
+    st->min = INFINITY;
+    st->max = -INFINITY;
+    for (size_t i = 0; i < a->ncell; ++i) {
+        if (!a->hit[i] || !b->hit[i]) {
+            st->only_a += a->hit[i] && !b->hit[i];
+            st->only_b += b->hit[i] && !a->hit[i];
+            a->hit[i] = 0;
+            continue;
+        }
+        const double d = b->grid[i] - a->grid[i];
+        a->grid[i] = d;
+        /* Welford's running mean and sum of squared deviations. */
+        ++st->both;
+        const double delta = d - st->mean;
+        st->mean += delta / (double)st->both;
+        st->m2 += delta * (d - st->mean);
+        st->sumsq += d * d;
+        if (d < st->min) st->min = d;
+        if (d > st->max) st->max = d;
+    }
+}
+
+static void diff_report(const DiffStats *st) {
+    fprintf(stderr, "diff: %zu cells in both inputs, %zu only in the first, %zu only in the second\n",
+            st->both, st->only_a, st->only_b);
+    if (!st->both) return;
+    const double n = (double)st->both;
+    fprintf(stderr, "diff: second - first: mean %.10g, std %.10g, rms %.10g, min %.10g, max %.10g\n",
+            st->mean, sqrt(st->m2 / n), sqrt(st->sumsq / n), st->min, st->max);
+}
+
+/* ------------------------------------------------------------------------ */
+/* Morphological filters (--morph)                                           */
+/* ------------------------------------------------------------------------ */
+
+/* A W x W min or max filter is separable: a 1-D pass along every row, then
+   one along every column. Each 1-D pass uses the van Herk/Gil-Werman
+   algorithm: the padded line is cut into blocks of W; g[j] is the extremum
+   from the start of j's block up to j and h[j] from j to the end of its
+   block, so the window [j, j + W - 1], which spans at most two blocks, is
+   pick(h[j], g[j + W - 1]): three comparisons per cell of the padded line.
+
+   Both passes are split into bands of rows taken by worker threads. The row
+   pass needs nothing outside a band; the column pass reads r = W/2 halo
+   rows above and below it, and runs across the band's rows with the inner
+   loop along x, so it streams through memory like the row pass. The halo
+   is read, and held in scratch, once per band, so a band is at least
+   MORPH_BAND_W windows tall (and a whole number of them): the halo then
+   adds at most 1/MORPH_BAND_W to the comparisons, where a fixed height
+   would let it dominate for large W. Cells outside the grid, and empty
+   cells, hold the neutral value (+inf for min, -inf for max) and so never
+   win. */
+
+#define MORPH_BAND   128      /* minimum band height, rows */
+#define MORPH_BAND_W 4        /* minimum band height, windows */
+
+static size_t morph_band(size_t r) {
+    const size_t w = 2 * r + 1;
+    size_t band = MORPH_BAND_W * w > MORPH_BAND ? MORPH_BAND_W * w : MORPH_BAND;
+    return (band + w - 1) / w * w;
+}
+
+typedef struct {
+    const double *src;
+    double *dst;
+    size_t nx, ny, r;
+    bool max;
+    bool cols;                /* column pass (else row pass) */
+    size_t band;              /* rows per band, morph_band(r) */
+    size_t nbands;
+    size_t next;              /* next band, taken atomically */
+} MorphPass;
+
+static inline double morph_pick(bool max, double a, double b) {
+    return max ? (a > b ? a : b) : (a < b ? a : b);
+}
+
+/* One row: dst[x] = extremum of src[x - r .. x + r]. h has n + 2r slots.
+   Inlined with max constant, once for each filter. */
+static inline __attribute__((always_inline))
+void morph_row(const MorphPass *mp, bool max, const double *src, double *dst, double *h) {
+    const size_t n = mp->nx, r = mp->r, w = 2 * r + 1, len = n + 2 * r;
+    const double e = max ? -INFINITY : INFINITY;
+    size_t pos = (len - 1) % w;               /* position of j within its block */
+    for (size_t j = len; j-- > 0; ) {
+        const double v = j >= r && j < r + n ? src[j - r] : e;
+        h[j] = pos == w - 1 || j == len - 1 ? v : morph_pick(max, h[j + 1], v);
+        pos = pos ? pos - 1 : w - 1;
+    }
+    double g = e;
+    pos = 0;
+    for (size_t j = 0; j < len; ++j) {
+        const double v = j >= r && j < r + n ? src[j - r] : e;
+        g = pos == 0 ? v : morph_pick(max, g, v);
+        if (j + 1 >= w) dst[j + 1 - w] = morph_pick(max, h[j + 1 - w], g);
+        pos = pos + 1 == w ? 0 : pos + 1;
+    }
+}
+
+/* Rows [y0, y1) of the column pass. h holds (y1 - y0 + 2r) rows, g one row;
+   none is a row of neutral values standing in for rows outside the grid. */
+static inline __attribute__((always_inline))
+void morph_cols(const MorphPass *mp, bool max, size_t y0, size_t y1, double *h, double *g,
+                const double *none) {
+    const size_t nx = mp->nx, r = mp->r, w = 2 * r + 1, len = y1 - y0 + 2 * r;
+    size_t pos = (len - 1) % w;
+    for (size_t j = len; j-- > 0; ) {
+        const size_t y = y0 + j - r;          /* wraps below row 0 */
+        const double *v = y < mp->ny ? mp->src + y * nx : none;
+        double *hj = h + j * nx;
+        if (pos == w - 1 || j == len - 1) {
+            memcpy(hj, v, nx * sizeof(double));
+        } else {
+            const double *hn = hj + nx;
+            for (size_t x = 0; x < nx; ++x) hj[x] = morph_pick(max, hn[x], v[x]);
+        }
+        pos = pos ? pos - 1 : w - 1;
+    }
+    pos = 0;
+    for (size_t j = 0; j < len; ++j) {
+        const size_t y = y0 + j - r;
+        const double *v = y < mp->ny ? mp->src + y * nx : none;
+        if (pos == 0) memcpy(g, v, nx * sizeof(double));
+        else for (size_t x = 0; x < nx; ++x) g[x] = morph_pick(max, g[x], v[x]);
+        if (j + 1 >= w) {
+            const double *hj = h + (j + 1 - w) * nx;
+            double *out = mp->dst + (y0 + j + 1 - w) * nx;
+            for (size_t x = 0; x < nx; ++x) out[x] = morph_pick(max, hj[x], g[x]);
+        }
+        pos = pos + 1 == w ? 0 : pos + 1;
+    }
+}
+
+HOT_KERNEL
+static void *morph_worker(void *arg) {
+    MorphPass *mp = (MorphPass*)arg;
+    const size_t nx = mp->nx, r = mp->r;
+    double *h, *g = NULL, *none = NULL;
+    if (mp->cols) {
+        h = (double*)malloc(safe_mul_size_t(safe_mul_size_t(mp->band + 2 * r, nx), sizeof(double)));
+        g = (double*)malloc(nx * sizeof(double));
+        none = (double*)malloc(nx * sizeof(double));
+        if (!g || !none) die("Out of memory in --morph");
+        for (size_t x = 0; x < nx; ++x) none[x] = mp->max ? -INFINITY : INFINITY;
+    } else {
+        h = (double*)malloc(safe_mul_size_t(nx + 2 * r, sizeof(double)));
+    }
+    if (!h) die("Out of memory in --morph");
+    for (;;) {
+        const size_t k = __atomic_fetch_add(&mp->next, 1, __ATOMIC_RELAXED);
+        if (k >= mp->nbands) break;
+        const size_t y0 = k * mp->band;
+        const size_t y1 = y0 + mp->band < mp->ny ? y0 + mp->band : mp->ny;
+        if (mp->cols) {
+            if (mp->max) morph_cols(mp, true, y0, y1, h, g, none);
+            else morph_cols(mp, false, y0, y1, h, g, none);
+        } else {
+            for (size_t y = y0; y < y1; ++y) {
+                if (mp->max) morph_row(mp, true, mp->src + y * nx, mp->dst + y * nx, h);
+                else morph_row(mp, false, mp->src + y * nx, mp->dst + y * nx, h);
+            }
+        }
+    }
+    free(h);
+    free(g);
+    free(none);
+    return NULL;
+}
+
+static void morph_pass(MorphPass *mp, int threads) {
+    mp->band = morph_band(mp->r);
+    mp->nbands = (mp->ny + mp->band - 1) / mp->band;
+    mp->next = 0;
+    int n = threads;
+    if ((size_t)n > mp->nbands) n = (int)mp->nbands;
+    pthread_t *tid = (pthread_t*)calloc((size_t)(n > 1 ? n : 1), sizeof(pthread_t));
+    if (!tid) die("Out of memory in --morph");
+    for (int i = 1; i < n; ++i)
+        if (pthread_create(&tid[i], NULL, morph_worker, mp) != 0) die("Failed to start --morph thread");
+    morph_worker(mp);
+    for (int i = 1; i < n; ++i) pthread_join(tid[i], NULL);
+    free(tid);
+}
+
+/* Min (max: dilation) filter of v, nx by ny, over (2r + 1)^2 windows, in
+   place; tmp holds the row pass. Cells to be ignored must already hold the
+   neutral value. */
+static void morph_filter(double *v, double *tmp, size_t nx, size_t ny, size_t r, bool max,
+                         int threads) {
+    if (r == 0) return;
+    MorphPass mp = { v, tmp, nx, ny, r, max, false, 0, 0, 0 };
+    morph_pass(&mp, threads);
+    mp.src = tmp;
+    mp.dst = v;
+    mp.cols = true;
+    morph_pass(&mp, threads);
+}
+
+/* Apply one --morph step to a grid in place. Empty cells, and occupied
+   cells holding NaN, are set to the neutral value before each elementary
+   filter so they never contribute; NaN cells keep their NaN. */
+static void morph_grid(Grid *g, MorphStep st, int threads, double *tmp) {
+    bool seq[2];
+    size_t nseq = 0;
+    switch (st.op) {
+    case MORPH_ERODE:  seq[nseq++] = false; break;
+    case MORPH_DILATE: seq[nseq++] = true; break;
+    case MORPH_OPEN:   seq[nseq++] = false; seq[nseq++] = true; break;
+    case MORPH_CLOSE:  seq[nseq++] = true; seq[nseq++] = false; break;
+    }
+    size_t *nan_idx = NULL, nnan = 0, cap = 0;
+    for (size_t i = 0; i < g->ncell; ++i) {
+        if (!g->hit[i] || g->grid[i] == g->grid[i]) continue;
+        if (nnan == cap) {
+            cap = cap ? 2 * cap : 64;
+            nan_idx = (size_t*)realloc(nan_idx, cap * sizeof(size_t));
+            if (!nan_idx) die("Out of memory in --morph");
+        }
+        nan_idx[nnan++] = i;
+    }
+    for (size_t k = 0; k < nseq; ++k) {
+        const double e = seq[k] ? -INFINITY : INFINITY;
+        for (size_t i = 0; i < g->ncell; ++i)
+            if (!g->hit[i]) g->grid[i] = e;
+        for (size_t i = 0; i < nnan; ++i) g->grid[nan_idx[i]] = e;
+        morph_filter(g->grid, tmp, g->nx, g->ny, st.w / 2, seq[k], threads);
+    }
+    for (size_t i = 0; i < nnan; ++i) g->grid[nan_idx[i]] = NAN;
+    free(nan_idx);
+}
+
+/* Run the --morph steps over every grid of a Binner. */
+static void binner_morph(Binner *b) {
+    const Options *opt = b->opt;
+    if (!opt->nmorph) return;
+    double *tmp = (double*)malloc(safe_mul_size_t(b->shape->ncell, sizeof(double)));
+    if (!tmp) die("Out of memory in --morph");
+    for (size_t k = 0; k < b->nlayer; ++k) {
+        Grid *g = b->layer[k] ? &b->layer[k]->g : NULL;
+        if (!g) continue;
+        for (size_t s = 0; s < opt->nmorph; ++s) morph_grid(g, opt->morph[s], opt->threads, tmp);
+        /* The filtered values no longer come from one point's token. */
+        ztok_release(g);
+    }
+    free(tmp);
+}
+
+/* ------------------------------------------------------------------------ */
+/* Ground filter (--ground)                                                  */
+/* ------------------------------------------------------------------------ */
+
+/* A simple morphological filter (SMRF, Pingel et al. 2013) on the binned
+   surface. Openings with square windows of radius k = 1, 2, ... cells, up to
+   the --ground window, are applied progressively, each to the previous
+   opened surface. A cell that step k lowers by more than slope * k * inc
+   stands on something narrower than the window and steeper than the slope
+   (a building, a tree) and is an object; the others are ground.
+
+   Each opening is an erosion and a dilation by morph_filter(), so a step
+   costs the same for every window and runs in parallel by row band with
+   halo rows. Empty and NaN cells stay out of every window and are neither
+   ground nor objects. */
+
+enum { GROUND_KEEP, GROUND_OBJECT, GROUND_SKIP };
+
+/* Classify the cells of g into cls (GROUND_*); returns the ground count.
+   cur, prev and tmp hold g->ncell doubles each. */
+static size_t ground_classify(const Grid *g, const Options *opt, unsigned char *cls,
+                              double *cur, double *prev, double *tmp) {
+    const size_t n = g->ncell;
+    for (size_t i = 0; i < n; ++i) {
+        cls[i] = g->hit[i] && g->grid[i] == g->grid[i] ? GROUND_KEEP : GROUND_SKIP;
+        cur[i] = g->grid[i];
+    }
+    double steps = ceil(opt->ground_window / opt->inc);
+    const size_t span = g->nx > g->ny ? g->nx : g->ny;
+    const size_t kmax = steps < 1 ? 1 : steps > (double)span ? span : (size_t)steps;
+    for (size_t k = 1; k <= kmax; ++k) {
+        double *t = prev; prev = cur; cur = t;
+        memcpy(cur, prev, n * sizeof(double));
+        for (size_t i = 0; i < n; ++i) if (cls[i] == GROUND_SKIP) cur[i] = INFINITY;
+        morph_filter(cur, tmp, g->nx, g->ny, k, false, opt->threads);
+        for (size_t i = 0; i < n; ++i) if (cls[i] == GROUND_SKIP) cur[i] = -INFINITY;
+        morph_filter(cur, tmp, g->nx, g->ny, k, true, opt->threads);
+        const double thr = opt->ground_slope * (double)k * opt->inc;
+        for (size_t i = 0; i < n; ++i)
+            if (cls[i] == GROUND_KEEP && prev[i] - cur[i] > thr) cls[i] = GROUND_OBJECT;
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < n; ++i) kept += cls[i] == GROUND_KEEP;
+    return kept;
+}
+
+/* Empty the object cells of every grid of a Binner. Each group is
+   classified on its first band; its other bands lose the same cells.
+   Ground cells keep their value (and token). Adds to *kept and *cells. */
+static void binner_ground(Binner *b, size_t *kept, size_t *cells) {
+    const Options *opt = b->opt;
+    const size_t n = b->shape->ncell;
+    unsigned char *cls = (unsigned char*)malloc(n);
+    double *cur = (double*)malloc(safe_mul_size_t(n, sizeof(double)));
+    double *prev = (double*)malloc(safe_mul_size_t(n, sizeof(double)));
+    double *tmp = (double*)malloc(safe_mul_size_t(n, sizeof(double)));
+    if (!cls || !cur || !prev || !tmp) die("Out of memory in --ground");
+    for (size_t k = 0; k < b->nlayer; k += opt->nband) {
+        if (!b->layer[k]) continue;
+        *kept += ground_classify(&b->layer[k]->g, opt, cls, cur, prev, tmp);
+        for (size_t i = 0; i < n; ++i) *cells += cls[i] != GROUND_SKIP;
+        for (size_t j = k; j < k + opt->nband; ++j) {
+            Grid *g = &b->layer[j]->g;
+            for (size_t i = 0; i < n; ++i) if (cls[i] == GROUND_OBJECT) g->hit[i] = 0;
+        }
+    }
+    free(cls);
+    free(cur);
+    free(prev);
+    free(tmp);
+}
+
+/* ------------------------------------------------------------------------ */
+/* Gap filling (--fill)                                                      */
+/* ------------------------------------------------------------------------ */
+
+/* Empty cells are filled on the grid itself and marked hit = 2, so they are
+   written (with the filled flag) but never act as data. The occupied cells
+   with a number are the sites; NaN cells are left alone.
+
+   nn is an exact Euclidean nearest-site transform in two separable passes
+   (Felzenszwalb and Huttenlocher): first, down and up every column, the
+   nearest site row in that column; then, along every row, the lower
+   envelope of the parabolas (x - q)^2 + dy(q)^2 over the columns q picks
+   the nearest site. The column pass works on strips of FILL_STRIP columns
+   and the row pass on bands of rows, each taken by worker threads, and
+   both stream through memory in row order. idw averages the sites within
+   the radius with weights 1/d^2, one band of rows per task: gathered from
+   the sites around each empty cell, or, when sites are the fewer, scattered
+   from each site into the band's sums, so the work follows the smaller
+   set. */
+
+#define FILL_STRIP 1024
+#define FILL_BAND  64
+#define FILL_NONE_ROW SIZE_MAX
+
+typedef struct {
+    const Options *opt;
+    Grid *const *band;        /* bands of one group; band[0] decides */
+    size_t nband;
+    const unsigned char *site;
+    size_t *near;             /* nn: nearest site row in the column */
+    size_t nx, ny;
+    bool rows;                /* nn row pass, or idw (else nn column pass) */
+    bool scatter;             /* idw from the sites (else from the empty cells) */
+    size_t ntask;
+    size_t next;              /* next strip or band, taken atomically */
+    size_t filled;
+} FillPass;
+
+/* Copy the site at sidx into the empty cell idx, in every band. */
+static inline void fill_copy(const FillPass *fp, size_t idx, size_t sidx) {
+    for (size_t k = 0; k < fp->nband; ++k) {
+        Grid *g = fp->band[k];
+        g->grid[idx] = g->grid[sidx];
+        g->hit[idx] = 2;
+    }
+}
+
+/* nn, columns [x0, x1): near = row of the nearest site in the column. */
+static void fill_cols(FillPass *fp, size_t x0, size_t x1) {
+    const size_t nx = fp->nx;
+    for (size_t y = 0; y < fp->ny; ++y) {
+        size_t *nr = fp->near + y * nx;
+        const unsigned char *st = fp->site + y * nx;
+        const size_t *up = y ? nr - nx : NULL;
+        for (size_t x = x0; x < x1; ++x)
+            nr[x] = st[x] ? y : up ? up[x] : FILL_NONE_ROW;
+    }
+    /* Upward: a site below wins when it is strictly nearer. */
+    for (size_t y = fp->ny - 1; y-- > 0; ) {
+        size_t *nr = fp->near + y * nx;
+        for (size_t x = x0; x < x1; ++x) {
+            const size_t below = nr[x + nx];
+            if (below != FILL_NONE_ROW && below > y &&
+                (nr[x] == FILL_NONE_ROW || below - y < y - nr[x])) nr[x] = below;
+        }
+    }
+}
+
+/* nn, one row: lower envelope of the parabolas f(q) + (x - q)^2 with
+   f(q) = (y - near(q))^2. v and z hold nx and nx + 1 slots. */
+static size_t fill_nn_row(FillPass *fp, size_t y, size_t *v, double *z) {
+    const size_t nx = fp->nx;
+    const size_t *nr = fp->near + y * nx;
+    size_t k = 0, nv = 0;
+    for (size_t q = 0; q < nx; ++q) {
+        if (nr[q] == FILL_NONE_ROW) continue;
+        const double dq = (double)(y > nr[q] ? y - nr[q] : nr[q] - y);
+        const double fq = dq * dq + (double)q * (double)q;
+        if (!nv) { v[0] = q; z[0] = -INFINITY; z[1] = INFINITY; nv = 1; k = 0; continue; }
+        double sx;
+        for (;;) {
+            const size_t p = v[k];
+            const double dp = (double)(y > nr[p] ? y - nr[p] : nr[p] - y);
+            sx = (fq - (dp * dp + (double)p * (double)p)) / (2.0 * ((double)q - (double)p));
+            if (sx > z[k] || k == 0) break;
+            --k;
+        }
+        ++k;
+        v[k] = q; z[k] = sx; z[k + 1] = INFINITY;
+        nv = k + 1;
+    }
+    if (!nv) return 0;
+    size_t filled = 0;
+    k = 0;
+    const unsigned char *hit = fp->band[0]->hit + y * nx;
+    for (size_t x = 0; x < nx; ++x) {
+        while (z[k + 1] < (double)x) ++k;
+        if (hit[x]) continue;
+        fill_copy(fp, y * nx + x, nr[v[k]] * nx + v[k]);
+        ++filled;
+    }
+    return filled;
+}
+
+/* idw, one row: each empty cell gets sum(w z) / sum(w), w = 1/d^2, over the
+   sites within the radius (r cells, d in cells). */
+static size_t fill_idw_row(FillPass *fp, size_t y) {
+    const size_t nx = fp->nx, ny = fp->ny;
+    const double rr = fp->opt->fill_radius / fp->opt->inc;
+    const size_t r = (size_t)rr;
+    const unsigned char *hit = fp->band[0]->hit + y * nx;
+    const size_t ya = y > r ? y - r : 0, yb = y + r < ny ? y + r : ny - 1;
+    size_t filled = 0;
+    double sum[BAND_MAX];
+    for (size_t x = 0; x < nx; ++x) {
+        if (hit[x]) continue;
+        const size_t xa = x > r ? x - r : 0, xb = x + r < nx ? x + r : nx - 1;
+        double wsum = 0.0;
+        for (size_t k = 0; k < fp->nband; ++k) sum[k] = 0.0;
+        for (size_t sy = ya; sy <= yb; ++sy) {
+            const double dy = (double)sy - (double)y;
+            const unsigned char *st = fp->site + sy * nx;
+            for (size_t sx = xa; sx <= xb; ++sx) {
+                if (!st[sx]) continue;
+                const double dx = (double)sx - (double)x, d2 = dx * dx + dy * dy;
+                if (d2 > rr * rr) continue;
+                const double w = 1.0 / d2;
+                wsum += w;
+                for (size_t k = 0; k < fp->nband; ++k) sum[k] += w * fp->band[k]->grid[sy * nx + sx];
+            }
+        }
+        if (wsum == 0.0) continue;
+        for (size_t k = 0; k < fp->nband; ++k) {
+            fp->band[k]->grid[y * nx + x] = sum[k] / wsum;
+            fp->band[k]->hit[y * nx + x] = 2;
+        }
+        ++filled;
+    }
+    return filled;
+}
+
+/* idw, rows [y0, y1) from the sites: acc holds the weight sum, then one
+   weighted sum per band, for each cell of the band of rows. */
+static size_t fill_idw_scatter(FillPass *fp, size_t y0, size_t y1, double *acc) {
+    const size_t nx = fp->nx, ny = fp->ny, nb = fp->nband, len = (y1 - y0) * nx;
+    const double rr = fp->opt->fill_radius / fp->opt->inc;
+    const size_t r = (size_t)rr;
+    memset(acc, 0, (nb + 1) * len * sizeof(double));
+    const size_t ya = y0 > r ? y0 - r : 0, yb = y1 + r < ny ? y1 + r : ny;
+    for (size_t sy = ya; sy < yb; ++sy) {
+        const unsigned char *st = fp->site + sy * nx;
+        const size_t ta = sy > y0 + r ? sy - r : y0, tb = sy + r + 1 < y1 ? sy + r + 1 : y1;
+        for (size_t sx = 0; sx < nx; ++sx) {
+            if (!st[sx]) continue;
+            const size_t xa = sx > r ? sx - r : 0, xb = sx + r < nx ? sx + r : nx - 1;
+            for (size_t ty = ta; ty < tb; ++ty) {
+                const double dy = (double)ty - (double)sy;
+                const unsigned char *hit = fp->band[0]->hit + ty * nx;
+                double *a = acc + (ty - y0) * nx;
+                for (size_t tx = xa; tx <= xb; ++tx) {
+                    const double dx = (double)tx - (double)sx, d2 = dx * dx + dy * dy;
+                    if (hit[tx] || d2 > rr * rr) continue;
+                    const double w = 1.0 / d2;
+                    a[tx] += w;
+                    for (size_t k = 0; k < nb; ++k) a[tx + (k + 1) * len] += w * fp->band[k]->grid[sy * nx + sx];
+                }
+            }
+        }
+    }
+    size_t filled = 0;
+    for (size_t i = 0; i < len; ++i) {
+        if (acc[i] == 0.0) continue;
+        for (size_t k = 0; k < nb; ++k) {
+            fp->band[k]->grid[y0 * nx + i] = acc[i + (k + 1) * len] / acc[i];
+            fp->band[k]->hit[y0 * nx + i] = 2;
+        }
+        ++filled;
+    }
+    return filled;
+}
+
+HOT_KERNEL
+static void *fill_worker(void *arg) {
+    FillPass *fp = (FillPass*)arg;
+    const bool nn = fp->opt->fill == FILL_NN;
+    size_t *v = NULL;
+    double *z = NULL;
+    if (fp->rows && nn) {
+        v = (size_t*)malloc(safe_mul_size_t(fp->nx, sizeof(size_t)));
+        z = (double*)malloc(safe_mul_size_t(fp->nx + 1, sizeof(double)));
+        if (!v || !z) die("Out of memory in --fill");
+    } else if (fp->rows && fp->scatter) {
+        z = (double*)malloc(safe_mul_size_t(safe_mul_size_t(fp->nband + 1, FILL_BAND * fp->nx), sizeof(double)));
+        if (!z) die("Out of memory in --fill");
+    }
+    size_t filled = 0;
+    for (;;) {
+        const size_t k = __atomic_fetch_add(&fp->next, 1, __ATOMIC_RELAXED);
+        if (k >= fp->ntask) break;
+        if (!fp->rows) {
+            const size_t x0 = k * FILL_STRIP;
+            fill_cols(fp, x0, x0 + FILL_STRIP < fp->nx ? x0 + FILL_STRIP : fp->nx);
+            continue;
+        }
+        const size_t y0 = k * FILL_BAND, y1 = y0 + FILL_BAND < fp->ny ? y0 + FILL_BAND : fp->ny;
+        if (!nn && fp->scatter) filled += fill_idw_scatter(fp, y0, y1, z);
+        else for (size_t y = y0; y < y1; ++y) filled += nn ? fill_nn_row(fp, y, v, z) : fill_idw_row(fp, y);
+    }
+    __atomic_fetch_add(&fp->filled, filled, __ATOMIC_RELAXED);
+    free(v);
+    free(z);
+    return NULL;
+}
+
+static void fill_run(FillPass *fp, bool rows, int threads) {
+    fp->rows = rows;
+    fp->ntask = rows ? (fp->ny + FILL_BAND - 1) / FILL_BAND : (fp->nx + FILL_STRIP - 1) / FILL_STRIP;
+    fp->next = 0;
+    int n = threads;
+    if ((size_t)n > fp->ntask) n = (int)fp->ntask;
+    pthread_t *tid = (pthread_t*)calloc((size_t)(n > 1 ? n : 1), sizeof(pthread_t));
+    if (!tid) die("Out of memory in --fill");
+    for (int i = 1; i < n; ++i)
+        if (pthread_create(&tid[i], NULL, fill_worker, fp) != 0) die("Failed to start --fill thread");
+    fill_worker(fp);
+    for (int i = 1; i < n; ++i) pthread_join(tid[i], NULL);
+    free(tid);
+}
+
+/* Fill the empty cells of every grid of a Binner. Adds to *filled and
+   *empty. */
+static void binner_fill(Binner *b, size_t *filled, size_t *empty) {
+    const Options *opt = b->opt;
+    const Grid *shape = b->shape;
+    const size_t n = shape->ncell;
+    unsigned char *site = (unsigned char*)malloc(n);
+    size_t *near = opt->fill == FILL_NN ? (size_t*)malloc(safe_mul_size_t(n, sizeof(size_t))) : NULL;
+    if (!site || (opt->fill == FILL_NN && !near)) die("Out of memory in --fill");
+    for (size_t k = 0; k < b->nlayer; k += opt->nband) {
+        if (!b->layer[k]) continue;
+        Grid *band[BAND_MAX];
+        for (size_t j = 0; j < opt->nband; ++j) band[j] = &b->layer[k + j]->g;
+        const Grid *g = band[0];
+        size_t nsite = 0, nempty = 0;
+        for (size_t i = 0; i < n; ++i) {
+            site[i] = g->hit[i] && g->grid[i] == g->grid[i];
+            nsite += site[i];
+            nempty += !g->hit[i];
+        }
+        *empty += nempty;
+        if (!nsite) continue;
+        FillPass fp = { opt, band, opt->nband, site, near, shape->nx, shape->ny, false,
+                        nsite < nempty, 0, 0, 0 };
+        if (opt->fill == FILL_NN) fill_run(&fp, false, opt->threads);
+        fill_run(&fp, true, opt->threads);
+        *filled += fp.filled;
+    }
+    free(site);
+    free(near);
+}
+
+/* ------------------------------------------------------------------------ */
+/* Polygon masks (--mask)                                                    */
+/* ------------------------------------------------------------------------ */
+
+/* The mask file is read into rings: a GMT multi-segment file ('>' starts a
+   new polygon, '#' a comment, "x y" per line, blanks or commas between) or a
+   GeoJSON file (the rings of every Polygon and MultiPolygon geometry). The
+   rings are rasterized once, by scanlines through the cell nodes, into one
+   bit per cell; a cell is inside when its node is, by the even-odd rule over
+   all rings, so holes need no special handling. Ingest then tests one bit. */
+
+typedef struct {
+    double x, y;
+} Vertex;
+
+typedef struct {
+    Vertex *v;
+    size_t n, cap;
+    size_t *start;       /* ring k is v[start[k] .. start[k + 1]) */
+    size_t nring, rcap;
+    size_t open;         /* first vertex of the ring being read */
+} Rings;
+
+typedef struct {
+    double x0, y0, x1, y1;   /* y0 < y1 */
+} Edge;
+
+static void mask_fail(const char *path, const char *what, size_t line) {
+    if (line) fprintf(stderr, "--mask %s: %s at line %zu\n", path, what, line);
+    else fprintf(stderr, "--mask %s: %s\n", path, what);
+    exit(EXIT_FAILURE);
+}
+
+static void rings_add(Rings *r, double x, double y) {
+    if (r->n == r->cap) {
+        r->cap = r->cap ? 2 * r->cap : 1024;
+        Vertex *nv = (Vertex*)realloc(r->v, safe_mul_size_t(r->cap, sizeof(Vertex)));
+        if (!nv) die("Out of memory reading mask");
+        r->v = nv;
+    }
+    r->v[r->n].x = x;
+    r->v[r->n].y = y;
+    ++r->n;
+}
+
+/* End the ring being read; fewer than three vertices enclose nothing. */
+static void rings_close(Rings *r) {
+    if (r->n - r->open < 3) { r->n = r->open; return; }
+    if (r->nring + 2 > r->rcap) {
+        r->rcap = r->rcap ? 2 * r->rcap : 64;
+        size_t *ns = (size_t*)realloc(r->start, safe_mul_size_t(r->rcap, sizeof(size_t)));
+        if (!ns) die("Out of memory reading mask");
+        r->start = ns;
+    }
+    r->start[r->nring++] = r->open;
+    r->start[r->nring] = r->n;
+    r->open = r->n;
+}
+
+static char *read_text_file(const char *path, size_t *len) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) mask_fail(path, strerror(errno), 0);
+    struct stat st;
+    if (fstat(fd, &st) != 0) mask_fail(path, strerror(errno), 0);
+    const size_t size = (size_t)st.st_size;
+    char *buf = (char*)malloc(size + 1);
+    if (!buf) die("Out of memory reading mask");
+    const size_t n = pread_full(fd, buf, size, 0);
+    close(fd);
+    buf[n] = '\0';
+    *len = n;
+    return buf;
+}
+
+static void mask_read_gmt(const char *path, char *text, Rings *r) {
+    size_t line = 0;
+    for (char *p = text; *p; ) {
+        char *nl = strchr(p, '\n');
+        if (nl) *nl = '\0';
+        ++line;
+        char *q = p;
+        while (*q == ' ' || *q == '\t' || *q == '\r') ++q;
+        if (*q == '>') {
+            rings_close(r);
+        } else if (*q && *q != '#') {
+            char *end = NULL;
+            const double x = strtod(q, &end);
+            if (end == q) mask_fail(path, "expected x y", line);
+            q = end;
+            while (*q == ' ' || *q == '\t' || *q == ',') ++q;
+            const double y = strtod(q, &end);
+            if (end == q) mask_fail(path, "expected x y", line);
+            rings_add(r, x, y);
+        }
+        if (!nl) break;
+        p = nl + 1;
+    }
+    rings_close(r);
+}
+
+/* Minimal GeoJSON reader: walks the whole document and collects rings from
+   the "coordinates" of objects whose "type" is Polygon or MultiPolygon. */
+typedef struct {
+    const char *p;
+    const char *path;
+    Rings *r;
+    int depth;
+} Json;
+
+static void json_ws(Json *j) {
+    while (*j->p == ' ' || *j->p == '\t' || *j->p == '\n' || *j->p == '\r') ++j->p;
+}
+
+static void json_expect(Json *j, char c) {
+    json_ws(j);
+    if (*j->p != c) mask_fail(j->path, "invalid GeoJSON", 0);
+    ++j->p;
+}
+
+/* Skip a string; copy up to cap-1 bytes of it into out when out is given. */
+static void json_string(Json *j, char *out, size_t cap) {
+    json_expect(j, '"');
+    size_t n = 0;
+    while (*j->p != '"') {
+        if (!*j->p) mask_fail(j->path, "unterminated string in GeoJSON", 0);
+        if (*j->p == '\\' && j->p[1]) ++j->p;
+        if (out && n + 1 < cap) out[n++] = *j->p;
+        ++j->p;
+    }
+    ++j->p;
+    if (out) out[n] = '\0';
+}
+
+/* Parse a coordinates array. A position [x, y, ...] is returned in *pos; an
+   array of positions is a ring and is added to j->r. */
+static bool json_coords(Json *j, Vertex *pos) {
+    json_expect(j, '[');
+    if (++j->depth > 64) mask_fail(j->path, "GeoJSON nested too deeply", 0);
+    json_ws(j);
+    bool position = false, ring = false;
+    size_t k = 0;
+    while (*j->p != ']') {
+        if (k++) json_expect(j, ',');
+        json_ws(j);
+        if (*j->p == '[') {
+            Vertex v;
+            if (json_coords(j, &v)) {
+                rings_add(j->r, v.x, v.y);
+                ring = true;
+            }
+        } else {
+            char *end = NULL;
+            const double v = strtod(j->p, &end);
+            if (end == j->p) mask_fail(j->path, "invalid number in GeoJSON coordinates", 0);
+            if (k == 1) pos->x = v;
+            else if (k == 2) pos->y = v;
+            j->p = end;
+            position = k >= 2;
+        }
+        json_ws(j);
+    }
+    ++j->p;
+    --j->depth;
+    if (ring) rings_close(j->r);
+    return position;
+}
+
+static void json_value(Json *j);
+
+static void json_object(Json *j) {
+    json_expect(j, '{');
+    char type[32] = "";
+    const char *coords = NULL;
+    json_ws(j);
+    for (size_t k = 0; *j->p != '}'; ++k) {
+        if (k) json_expect(j, ',');
+        char key[32];
+        json_ws(j);
+        json_string(j, key, sizeof(key));
+        json_expect(j, ':');
+        json_ws(j);
+        if (!strcmp(key, "type") && *j->p == '"') json_string(j, type, sizeof(type));
+        else {
+            if (!strcmp(key, "coordinates")) coords = j->p;
+            json_value(j);
+        }
+        json_ws(j);
+    }
+    ++j->p;
+    if (coords && (!strcmp(type, "Polygon") || !strcmp(type, "MultiPolygon"))) {
+        const char *resume = j->p;
+        Vertex unused;
+        j->p = coords;
+        (void)json_coords(j, &unused);
+        j->p = resume;
+    }
+}
+
+static void json_value(Json *j) {
+    json_ws(j);
+    if (++j->depth > 64) mask_fail(j->path, "GeoJSON nested too deeply", 0);
+    const char c = *j->p;
+    if (c == '{') {
+        json_object(j);
+    } else if (c == '[') {
+        ++j->p;
+        json_ws(j);
+        for (size_t k = 0; *j->p != ']'; ++k) {
+            if (k) json_expect(j, ',');
+            json_value(j);
+            json_ws(j);
+        }
+        ++j->p;
+    } else if (c == '"') {
+        json_string(j, NULL, 0);
+    } else {
+        /* number, true, false or null */
+        const char *s = j->p;
+        while (*j->p && !strchr(",]} \t\r\n", *j->p)) ++j->p;
+        if (j->p == s) mask_fail(j->path, "invalid GeoJSON", 0);
+    }
+    --j->depth;
+}
+
+static void mask_read(const char *path, Rings *r) {
+    size_t len;
+    char *text = read_text_file(path, &len);
+    const char *p = text;
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') ++p;
+    if (*p == '{') {
+        Json j = { text, path, r, 0 };
+        json_value(&j);
+    } else {
+        mask_read_gmt(path, text, r);
+    }
+    free(text);
+    if (!r->nring) mask_fail(path, "no polygons found", 0);
+}
+
+static int cmp_edge(const void *a, const void *b) {
+    const double x = ((const Edge*)a)->y0, y = ((const Edge*)b)->y0;
+    return (x > y) - (x < y);
+}
+
+static int cmp_double(const void *a, const void *b) {
+    const double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/* Rasterize the rings at the cell nodes. Rows are visited in increasing y,
+   keeping an active list of the edges that span the row (y0 <= y < y1, so a
+   vertex on the row is counted once); the sorted crossings pair up into
+   inside intervals [x0, x1), the same half-open rule as in y, so a node on
+   an edge shared by two polygons (or a polygon and its hole) lands in
+   exactly one of them. */
+static uint64_t *mask_raster(const Rings *r, const Options *opt, const Grid *g, size_t *inside) {
+    size_t ne = 0;
+    Edge *e = (Edge*)malloc(safe_mul_size_t(r->n ? r->n : 1, sizeof(Edge)));
+    if (!e) die("Out of memory rasterizing mask");
+    for (size_t k = 0; k < r->nring; ++k) {
+        const size_t a = r->start[k], n = r->start[k + 1] - a;
+        for (size_t i = 0; i < n; ++i) {
+            const Vertex p = r->v[a + i], q = r->v[a + (i + 1) % n];
+            if (p.y == q.y || p.y != p.y || q.y != q.y) continue;
+            Edge *ed = &e[ne++];
+            if (p.y < q.y) { ed->x0 = p.x; ed->y0 = p.y; ed->x1 = q.x; ed->y1 = q.y; }
+            else           { ed->x0 = q.x; ed->y0 = q.y; ed->x1 = p.x; ed->y1 = p.y; }
+        }
+    }
+    qsort(e, ne, sizeof(Edge), cmp_edge);
+
+    const size_t words = g->ncell / 64 + 1;
+    uint64_t *bits = (uint64_t*)calloc(words, sizeof(uint64_t));
+    size_t *act = (size_t*)malloc(safe_mul_size_t(ne ? ne : 1, sizeof(size_t)));
+    double *xs = (double*)malloc(safe_mul_size_t(ne ? ne : 1, sizeof(double)));
+    if (!bits || !act || !xs) die("Out of memory rasterizing mask");
+    size_t nact = 0, next = 0;
+    *inside = 0;
+    for (size_t row = 0; row < g->ny; ++row) {
+        /* Default rows run up from ymin, --gmtbin rows down from ymax. */
+        const size_t iy = opt->gmt_bin ? g->ny - 1 - row : row;
+        double gx0, gy;
+        cell_node(opt, 0, iy, &gx0, &gy);
+        while (next < ne && e[next].y0 <= gy) act[nact++] = next++;
+        size_t nx = 0;
+        for (size_t i = 0; i < nact; ) {
+            const Edge *ed = &e[act[i]];
+            if (ed->y1 <= gy) { act[i] = act[--nact]; continue; }
+            xs[nx++] = ed->x0 + (gy - ed->y0) * (ed->x1 - ed->x0) / (ed->y1 - ed->y0);
+            ++i;
+        }
+        qsort(xs, nx, sizeof(double), cmp_double);
+        for (size_t i = 0; i + 1 < nx; i += 2) {
+            /* Columns whose node lies in [xs[i], xs[i + 1]). */
+            double c = ceil(cell_units(opt, xs[i] - opt->xmin));
+            if (!(c < (double)g->nx)) continue;
+            size_t lo = c > 0.0 ? (size_t)c : 0;
+            double gx, unused;
+            while (lo > 0 && (cell_node(opt, lo - 1, iy, &gx, &unused), gx >= xs[i])) --lo;
+            while (lo < g->nx && (cell_node(opt, lo, iy, &gx, &unused), gx < xs[i])) ++lo;
+            for (size_t ix = lo; ix < g->nx; ++ix) {
+                cell_node(opt, ix, iy, &gx, &unused);
+                if (gx >= xs[i + 1]) break;
+                const size_t idx = ix + g->nx * iy;
+                if (!(bits[idx >> 6] >> (idx & 63) & 1)) {
+                    bits[idx >> 6] |= (uint64_t)1 << (idx & 63);
+                    ++*inside;
+                }
+            }
+        }
+    }
+    free(e);
+    free(act);
+    free(xs);
+    return bits;
+}
+
+static uint64_t *mask_build(const Options *opt, const Grid *g) {
+    Rings r;
+    memset(&r, 0, sizeof(r));
+    mask_read(opt->mask, &r);
+    size_t inside;
+    uint64_t *bits = mask_raster(&r, opt, g, &inside);
+    fprintf(stderr, "mask %s: %zu polygon ring%s, %zu of %zu cells inside\n", opt->mask,
+            r.nring, r.nring == 1 ? "" : "s", inside, g->ncell);
+    free(r.v);
+    free(r.start);
+    return bits;
+}
+
+/* ------------------------------------------------------------------------ */
+/* Output                                                                    */
+/* ------------------------------------------------------------------------ */
+
+/* One output value column: cell idx of g, after the separating blank. */
+static inline void write_z(const Options *opt, const Grid *g, size_t idx, FILE *fout) {
+    if (opt->tcl_fmt && !opt->gmt_bin && g->grid_tok && g->hit[idx] != 2) {
+        char buf[ZTOK_TEXT_MAX];
+        fprintf(fout, " %s", ztok_format(g->grid_tok[idx], buf));
+    } else {
+        fprintf(fout, " %.10g", g->grid[idx]);
+    }
+}
+
+/* Write the cells of columns [x0, x1) and rows [y0, y1) that received data
+   (only those changed this run when dirty): x y, then one column per band
+   (the bands share their hit cells), then with --fill the filled flag. A
+   single band is written with one fprintf() per row. */
+HOT_KERNEL
+static void write_cells(const Options *opt, const Grid *const *band, size_t nband,
+                        size_t x0, size_t x1, size_t y0, size_t y1, bool dirty, FILE *fout) {
+    const Grid *g = band[0];
+    for (size_t iy = y0; iy < y1; ++iy) {
+        for (size_t ix = x0; ix < x1; ++ix) {
+            size_t idx = ix + g->nx * iy;
+            if (!g->hit[idx] || (g->hit[idx] != 1 && dirty)) continue;
+            double gx, gy;
+            cell_node(opt, ix, iy, &gx, &gy);
+            if (nband > 1 || opt->fill) {
+                if (opt->gmt_bin || opt->tcl_fmt) fprintf(fout, "%.1f %.1f", gx, gy);
+                else fprintf(fout, "%.10g %.10g", gx, gy);
+                for (size_t k = 0; k < nband; ++k) write_z(opt, band[k], idx, fout);
+                if (opt->fill) fputs(g->hit[idx] == 2 ? " 1" : " 0", fout);
+                putc('\n', fout);
+                continue;
+            }
+            double gz = g->grid[idx];
+            if (opt->gmt_bin) {
+                /* Match GMT table formatting expectation in compare script: x,y %.1f, z numeric */
+                fprintf(fout, "%.1f %.1f %.10g\n", gx, gy, gz);
+            } else if (!opt->tcl_fmt) {
+                /* Compact formatting */
+                fprintf(fout, "%.10g %.10g %.10g\n", gx, gy, gz);
+            } else {
+                if (g->grid_tok) {
+                    char buf[ZTOK_TEXT_MAX];
+                    fprintf(fout, "%.1f %.1f %s\n", gx, gy, ztok_format(g->grid_tok[idx], buf));
+                } else {
+                    /* No token: --reducer sum, or a snapshot */
+                    fprintf(fout, "%.1f %.1f %.10g\n", gx, gy, gz);
+                }
+            }
+        }
+    }
+}
+
+static void write_grid(const Options *opt, const Grid *const *band, size_t nband, FILE *fout) {
+    write_cells(opt, band, nband, 0, band[0]->nx, 0, band[0]->ny, opt->delta, fout);
+}
+
+/* Write the band layers l[0..nband) as one table. */
+static void write_layers(const Options *opt, Layer *const *l, FILE *fout) {
+    const Grid *band[BAND_MAX];
+    for (size_t k = 0; k < opt->nband; ++k) band[k] = &l[k]->g;
+    write_grid(opt, band, opt->nband, fout);
+}
+
+/* Output name suffix of a --groupby layer: the range name, the value, or
+   the range as lo-hi. */
+static void group_label(const Options *opt, const Layer *l, char *buf, size_t cap) {
+    if (!opt->ngroup) { snprintf(buf, cap, "%.10g", l->group); return; }
+    const size_t k = (size_t)l->group;
+    if (opt->group_name[k]) snprintf(buf, cap, "%s", opt->group_name[k]);
+    else if (opt->group_lo[k] == opt->group_hi[k]) snprintf(buf, cap, "%.10g", opt->group_lo[k]);
+    else snprintf(buf, cap, "%.10g-%.10g", opt->group_lo[k], opt->group_hi[k]);
+}
+
+/* Compares groups by the value of their first band layer. */
+static int cmp_layer_group(const void *a, const void *b) {
+    const double x = (*(Layer *const *)a)->group, y = (*(Layer *const *)b)->group;
+    return (x > y) - (x < y);
+}
+
+/* --groupby: write each group that received points to <out>.<group>, in
+   range order, or by value without ranges. */
+static void write_groups(const Options *opt, const Binner *b, const char *note) {
+    const size_t nb = opt->nband;
+    if (!opt->ngroup) qsort(b->layer, b->nlayer / nb, nb * sizeof(Layer*), cmp_layer_group);
+    const size_t n = strlen(opt->out) + 2 + 64;
+    char *path = (char*)malloc(n);
+    if (!path) die("Out of memory");
+    for (size_t k = 0; k < b->nlayer; k += nb) {
+        const Layer *l = b->layer[k];
+        if (!l) continue;
+        char label[64];
+        group_label(opt, l, label, sizeof(label));
+        snprintf(path, n, "%s.%s", opt->out, label);
+        FILE *f = fopen(path, "w");
+        if (!f) die_perror("Failed to open output file");
+        fprintf(stderr, "write %s (%llu points)\n", path, l->points);
+        if (note) fputs(note, f);
+        write_layers(opt, &b->layer[k], f);
+        if (fclose(f) != 0) die_perror("Failed to write output file");
+    }
+    free(path);
+}
+
+/* ------------------------------------------------------------------------ */
+/* Tile pyramid (--tiles)                                                    */
+/* ------------------------------------------------------------------------ */
+
+/* Tiles are cut from the north-west corner of the grid: rows are counted
+   from the north (r = 0 is the northernmost) and tile y grows southward, as
+   in XYZ web tiles. Level z = L - 1 is the grid itself; each lower z merges
+   2x2 cells of the one above (min, max or sum) into arrays built before any
+   tile is written, so tile (z, x, y) covers tiles (z + 1, 2x..2x+1,
+   2y..2y+1). Every tile of every level is one task, taken by worker threads
+   through an atomic counter: the worker counts its tile's occupied cells,
+   skips the tile when there are none (with --delta, when none changed),
+   and otherwise writes its file. index.json is written afterwards, in z,
+   y, x order. */
+
+typedef struct {
+    size_t nx, ny;            /* cells */
+    size_t scale;             /* grid cells across one cell */
+    double *v;                /* rows from the north; NULL for the grid itself */
+    unsigned char *hit;
+    size_t ntx, nty;          /* tiles across and down */
+    size_t first;             /* task number of tile (0, 0) */
+} TileLevel;
+
+typedef struct {
+    const Options *opt;
+    const Grid *g;
+    TileLevel *lev;           /* lev[0] is the grid, lev[k] merges 2^k x 2^k cells */
+    size_t nlev;
+    size_t ntask;
+    size_t next;              /* next task, taken atomically */
+    size_t *cells;            /* occupied cells per task; 0: not written */
+} TileJob;
+
+/* Cell (cx, r) of a level, r counted from the north; returns its hit byte. */
+static inline unsigned char tile_cell(const TileJob *tj, const TileLevel *lv, size_t cx, size_t r, double *v) {
+    size_t i;
+    if (lv->v) {
+        i = r * lv->nx + cx;
+        *v = lv->v[i];
+        return lv->hit[i];
+    }
+    const Grid *g = tj->g;
+    i = (tj->opt->gmt_bin ? r : g->ny - 1 - r) * g->nx + cx;
+    *v = g->grid[i];
+    return g->hit[i];
+}
+
+/* Build dst from src by merging 2x2 cells with the reducer. A merged cell
+   is changed (hit 1) when any of its cells is, else unchanged (3). */
+static void tile_merge(const TileJob *tj, const TileLevel *src, TileLevel *dst) {
+    const ReducerKind red = tj->opt->reducer;
+    for (size_t r = 0; r < dst->ny; ++r) {
+        for (size_t cx = 0; cx < dst->nx; ++cx) {
+            double acc = 0.0;
+            unsigned char hit = 0;
+            for (size_t k = 0; k < 4; ++k) {
+                const size_t sx = 2 * cx + (k & 1), sr = 2 * r + (k >> 1);
+                double v;
+                const unsigned char h = sx < src->nx && sr < src->ny ? tile_cell(tj, src, sx, sr, &v) : 0;
+                if (!h) continue;
+                if (!hit) acc = v;
+                else if (red == RED_SUM) acc += v;
+                else if (red == RED_MAX ? v > acc : v < acc) acc = v;
+                hit = h == 1 || hit == 1 ? 1 : 3;
+            }
+            dst->v[r * dst->nx + cx] = acc;
+            dst->hit[r * dst->nx + cx] = hit;
+        }
+    }
+}
+
+/* North-west corner of the grid's cells: the outer edge of cell (0, north). */
+static void tile_origin(const Options *opt, const Grid *g, double *west, double *north) {
+    cell_node(opt, 0, opt->gmt_bin ? 0 : g->ny - 1, west, north);
+    *west -= 0.5 * opt->inc;
+    *north += 0.5 * opt->inc;
+}
+
+/* Write tile task; row is the worker's buffer of tile-size floats. */
+static void tile_write(TileJob *tj, size_t task, float *row) {
+    const Options *opt = tj->opt;
+    size_t k = 0;
+    while (task >= tj->lev[k].first + tj->lev[k].ntx * tj->lev[k].nty) ++k;
+    const TileLevel *lv = &tj->lev[k];
+    const size_t t = task - lv->first, tx = t % lv->ntx, ty = t / lv->ntx, ts = opt->tile_size;
+    const size_t c0 = tx * ts, c1 = c0 + ts < lv->nx ? c0 + ts : lv->nx;
+    const size_t r0 = ty * ts, r1 = r0 + ts < lv->ny ? r0 + ts : lv->ny;
+    size_t n = 0, changed = 0;
+    for (size_t r = r0; r < r1; ++r)
+        for (size_t cx = c0; cx < c1; ++cx) {
+            double v;
+            const unsigned char h = tile_cell(tj, lv, cx, r, &v);
+            n += h != 0;
+            changed += h == 1;
+        }
+    if (opt->delta && !changed) n = 0;
+    tj->cells[task] = n;
+    if (!n) return;
+
+    const size_t z = tj->nlev - 1 - k;
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%zu/%zu", opt->tiles, z, tx);
+    if (mkdir(path, 0777) != 0 && errno != EEXIST) die_perror("Failed to create tile directory");
+    snprintf(path, sizeof(path), "%s/%zu/%zu/%zu.%s", opt->tiles, z, tx, ty, opt->tile_f32 ? "f32" : "txt");
+    FILE *f = fopen(path, "wb");
+    if (!f) die_perror("Failed to open tile");
+    if (opt->tile_f32) {
+        for (size_t r = r0; r < r0 + ts; ++r) {
+            for (size_t i = 0; i < ts; ++i) {
+                double v;
+                row[i] = r < r1 && c0 + i < c1 && tile_cell(tj, lv, c0 + i, r, &v) ? (float)v : NAN;
+            }
+            fwrite(row, sizeof(float), ts, f);
+        }
+    } else if (!lv->v) {
+        /* The grid itself: the same rows as the full output. */
+        const Grid *g = tj->g;
+        const size_t y0 = opt->gmt_bin ? r0 : g->ny - r1, y1 = opt->gmt_bin ? r1 : g->ny - r0;
+        write_cells(opt, &g, 1, c0, c1, y0, y1, false, f);
+    } else {
+        /* Merged cells at their block centres, in the grid's row order. */
+        double west, north;
+        tile_origin(opt, tj->g, &west, &north);
+        const double w = (double)lv->scale * opt->inc;
+        for (size_t i = 0; i < r1 - r0; ++i) {
+            const size_t r = opt->gmt_bin ? r0 + i : r1 - 1 - i;
+            for (size_t cx = c0; cx < c1; ++cx) {
+                double v;
+                if (!tile_cell(tj, lv, cx, r, &v)) continue;
+                fprintf(f, "%.10g %.10g %.10g\n", west + ((double)cx + 0.5) * w, north - ((double)r + 0.5) * w, v);
+            }
+        }
+    }
+    if (ferror(f) | fclose(f)) die_perror("Failed to write tile");
+}
+
+HOT_KERNEL
+static void *tile_worker(void *arg) {
+    TileJob *tj = (TileJob*)arg;
+    float *row = NULL;
+    if (tj->opt->tile_f32) {
+        row = (float*)malloc(tj->opt->tile_size * sizeof(float));
+        if (!row) die("Out of memory in --tiles");
+    }
+    for (;;) {
+        const size_t k = __atomic_fetch_add(&tj->next, 1, __ATOMIC_RELAXED);
+        if (k >= tj->ntask) break;
+        tile_write(tj, k, row);
+    }
+    free(row);
+    return NULL;
+}
+
+/* Write the tiles of g and index.json to opt->tiles. */
+static void write_tiles(const Options *opt, const Grid *g) {
+    TileJob tj;
+    memset(&tj, 0, sizeof(tj));
+    tj.opt = opt;
+    tj.g = g;
+    tj.nlev = opt->tile_levels;
+    tj.lev = (TileLevel*)calloc(tj.nlev, sizeof(TileLevel));
+    if (!tj.lev) die("Out of memory in --tiles");
+    const size_t ts = opt->tile_size;
+    for (size_t k = 0; k < tj.nlev; ++k) {
+        TileLevel *lv = &tj.lev[k];
+        lv->nx = k ? (tj.lev[k - 1].nx + 1) / 2 : g->nx;
+        lv->ny = k ? (tj.lev[k - 1].ny + 1) / 2 : g->ny;
+        lv->scale = (size_t)1 << k;
+        lv->ntx = (lv->nx + ts - 1) / ts;
+        lv->nty = (lv->ny + ts - 1) / ts;
+        lv->first = tj.ntask;
+        tj.ntask += lv->ntx * lv->nty;
+        if (k) {
+            lv->v = (double*)malloc(safe_mul_size_t(safe_mul_size_t(lv->nx, lv->ny), sizeof(double)));
+            lv->hit = (unsigned char*)malloc(lv->nx * lv->ny);
+            if (!lv->v || !lv->hit) die("Out of memory in --tiles");
+            tile_merge(&tj, &tj.lev[k - 1], lv);
+        }
+    }
+    tj.cells = (size_t*)calloc(tj.ntask, sizeof(size_t));
+    if (!tj.cells) die("Out of memory in --tiles");
+
+    char path[4096];
+    if (mkdir(opt->tiles, 0777) != 0 && errno != EEXIST) die_perror("Failed to create --tiles directory");
+    for (size_t z = 0; z < tj.nlev; ++z) {
+        snprintf(path, sizeof(path), "%s/%zu", opt->tiles, z);
+        if (mkdir(path, 0777) != 0 && errno != EEXIST) die_perror("Failed to create tile directory");
+    }
+
+    int n = opt->threads;
+    if ((size_t)n > tj.ntask) n = (int)tj.ntask;
+    pthread_t *tid = (pthread_t*)calloc((size_t)(n > 1 ? n : 1), sizeof(pthread_t));
+    if (!tid) die("Out of memory in --tiles");
+    for (int i = 1; i < n; ++i)
+        if (pthread_create(&tid[i], NULL, tile_worker, &tj) != 0) die("Failed to start --tiles thread");
+    tile_worker(&tj);
+    for (int i = 1; i < n; ++i) pthread_join(tid[i], NULL);
+    free(tid);
+
+    snprintf(path, sizeof(path), "%s/index.json", opt->tiles);
+    FILE *f = fopen(path, "w");
+    if (!f) die_perror("Failed to open tile index");
+    double west, north;
+    tile_origin(opt, g, &west, &north);
+    fprintf(f, "{\"format\": \"%s\", \"tile_size\": %zu, \"levels\": %zu, \"delta\": %s, \"inc\": %.12g, "
+               "\"west\": %.12g, \"north\": %.12g, \"tiles\": [",
+            opt->tile_f32 ? "f32" : "text", ts, tj.nlev, opt->delta ? "true" : "false", opt->inc, west, north);
+    size_t written = 0;
+    for (size_t z = 0; z < tj.nlev; ++z) {
+        const TileLevel *lv = &tj.lev[tj.nlev - 1 - z];
+        const double span = (double)(ts * lv->scale) * opt->inc;
+        for (size_t t = 0; t < lv->ntx * lv->nty; ++t) {
+            const size_t cells = tj.cells[lv->first + t];
+            if (!cells) continue;
+            const size_t tx = t % lv->ntx, ty = t / lv->ntx;
+            fprintf(f, "%s\n  {\"z\": %zu, \"x\": %zu, \"y\": %zu, \"cells\": %zu, \"west\": %.12g, "
+                       "\"east\": %.12g, \"south\": %.12g, \"north\": %.12g}",
+                    written ? "," : "", z, tx, ty, cells, west + (double)tx * span,
+                    west + (double)(tx + 1) * span, north - (double)(ty + 1) * span, north - (double)ty * span);
+            ++written;
+        }
+    }
+    fprintf(f, "\n]}\n");
+    if (ferror(f) | fclose(f)) die_perror("Failed to write tile index");
+    fprintf(stderr, "wrote %zu of %zu tiles to %s (%zu level%s of %zu x %zu cells)%s\n", written, tj.ntask,
+            opt->tiles, tj.nlev, tj.nlev == 1 ? "" : "s", ts, ts, opt->delta ? ", changed only" : "");
+
+    for (size_t k = 1; k < tj.nlev; ++k) {
+        free(tj.lev[k].v);
+        free(tj.lev[k].hit);
+    }
+    free(tj.lev);
+    free(tj.cells);
+}
+
+/* ------------------------------------------------------------------------ */
+/* Progressive snapshots (--snapshot)                                        */
+/* ------------------------------------------------------------------------ */
+
+/* The binning thread checks the clock every 64K points. When a snapshot is
+   due it forks: the child holds the grid, and whatever the engines still
+   buffer (sort records, batches, runs), exactly as they were at that point,
+   and the kernel copies a page only when the binning thread next writes to
+   it, so ingest pays for the fork and those page copies only. The child
+   applies the buffered records to its copy, writes the grid to <file>.tmp,
+   renames it over <file> and exits; readers always see a complete grid of
+   one point in time. If the previous child is still writing when the next
+   snapshot is due, that one is skipped rather than waited for. The grid
+   must be private memory for the copy to be frozen, so --snapshot is not
+   available with --shm or --grid-file; it allows one grid only (no
+   --groupby, --zcols or --diff), so layer 0 is the whole result. */
+struct Snapshot {
+    const Options *opt;
+    pid_t child;               /* writer of the snapshot under way, or 0 */
+    unsigned seq;              /* snapshots started */
+    unsigned written;          /* snapshots written */
+    double due;                /* monotonic time of the next snapshot */
+};
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+}
+
+static bool snapshot_write(const Options *opt, const Grid *g, unsigned seq,
+                           unsigned long long points) {
+    const char *path = opt->snapshot;
+    size_t n = strlen(path) + 5;
+    char *tmp = (char*)malloc(n);
+    if (!tmp) die("Out of memory");
+    snprintf(tmp, n, "%s.tmp", path);
+    FILE *f = fopen(tmp, "w");
+    if (!f) {
+        fprintf(stderr, "snapshot: cannot open %s: %s\n", tmp, strerror(errno));
+        free(tmp);
+        return false;
+    }
+    fprintf(f, "# snapshot %u after %llu points\n", seq, points);
+    write_grid(opt, &g, 1, f);
+    const bool ok = !ferror(f) && fclose(f) == 0 && rename(tmp, path) == 0;
+    if (!ok) fprintf(stderr, "snapshot: cannot write %s: %s\n", path, strerror(errno));
+    free(tmp);
+    return ok;
+}
+
+static void snapshot_start(Snapshot *sn, const Options *opt) {
+    memset(sn, 0, sizeof(*sn));
+    sn->opt = opt;
+    sn->due = now_seconds() + opt->snapshot_every;
+}
+
+/* Reap the writer child; with wait false only if it has exited. Returns
+   whether no child is left. */
+static bool snapshot_reap(Snapshot *sn, bool wait) {
+    if (!sn->child) return true;
+    int st;
+    const pid_t r = waitpid(sn->child, &st, wait ? 0 : WNOHANG);
+    if (r == 0) return false;
+    if (r == sn->child && WIFEXITED(st) && WEXITSTATUS(st) == 0) ++sn->written;
+    sn->child = 0;
+    return true;
+}
+
+static void snapshot_poll(Binner *b) {
+    Snapshot *sn = b->snap;
+    const double now = now_seconds();
+    if (now < sn->due) return;
+    if (!snapshot_reap(sn, false)) return;
+    sn->due = now + b->opt->snapshot_every;
+    fflush(NULL);                /* nothing buffered for the child to repeat */
+    const pid_t pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "snapshot: cannot fork: %s\n", strerror(errno));
+        return;
+    }
+    ++sn->seq;
+    if (pid == 0) {
+        binner_flush(b);
+        _exit(snapshot_write(b->opt, &b->layer[0]->g, sn->seq, b->cnt.points) ? 0 : 1);
+    }
+    sn->child = pid;
+}
+
+/* Wait for the last writer child, then write a snapshot of the complete
+   grid. The engines have been flushed by then. */
+static void snapshot_finish(Snapshot *sn, const Grid *g, unsigned long long points) {
+    snapshot_reap(sn, true);
+    if (snapshot_write(sn->opt, g, ++sn->seq, points)) ++sn->written;
+}
+
+int main(int argc, char **argv) {
+    Options opt = parse_args(argc, argv);
+
+    PreScan ps;
+    memset(&ps, 0, sizeof(ps));
+    if (opt.region_auto) {
+        prescan_run(&opt, &ps);
+        prescan_region(&ps, &opt);
+        fprintf(stderr, "pre-scanned %zu bytes with %d thread%s%s\n", ps.size, ps.nparts,
+                ps.nparts == 1 ? "" : "s", ps.cached ? ", points cached" : "");
+    }
+
+    fprintf(stderr, "region %.12g %.12g %.12g %.12g\n",
+            opt.xmin, opt.xmax, opt.ymin, opt.ymax);
+
+    const double inc = opt.inc;
+
+    /* Compute grid dimensions. For normal (node-snapped) mode we keep node counts.
+       For GMT-bin mode, emulate GMT gridline registration node counts. */
+    size_t nx, ny;
+    if (!opt.gmt_bin) {
+        const double nx_d = floor(((opt.xmax - opt.xmin) / inc) + 0.5) + 1.0;
+        const double ny_d = floor(((opt.ymax - opt.ymin) / inc) + 0.5) + 1.0;
+        if (!(nx_d >= 1.0 && ny_d >= 1.0)) die("Computed grid dimensions invalid");
+        nx = (size_t)nx_d;
+        ny = (size_t)ny_d;
+    } else {
+        /* Node counts: n = urint(((max-min)/inc) + 1) */
+        double nxd = llround(((opt.xmax - opt.xmin) / inc)) + 1.0;
+        double nyd = llround(((opt.ymax - opt.ymin) / inc)) + 1.0;
+        if (!(nxd >= 1.0 && nyd >= 1.0)) die("Computed bin dimensions invalid");
+        nx = (size_t)nxd;
+        ny = (size_t)nyd;
+    }
+
+    fprintf(stderr, "%zu columns by %zu rows\n", nx, ny);
+
+    Grid shape;
+    grid_shape(&shape, &opt, nx, ny);
+
+    Binner b, b2;
+    binner_init(&b, &opt, &shape);
+    if (opt.diff) binner_init(&b2, &opt, &shape);
+    if (opt.qt_split) {
+        fprintf(stderr, "quadtree of %zu x %zu blocks of %u cells, split above %u points\n",
+                b.qt->rnx, b.qt->rny, 1u << opt.qt_levels, opt.qt_split);
+    } else if (!opt.group_col) {
+        fprintf(stderr, "initialised ar(x,y)%s\n", opt.diff ? " for both inputs" : "");
+    } else {
+        fprintf(stderr, "one grid per group of column %d, allocated on first use\n", opt.group_col);
+    }
+
+    /* Open files */
+    FILE *fout = NULL;
+    if (opt.out && !opt.group_col) {
+        fout = fopen(opt.out, "w");
+        if (!fout) die_perror("Failed to open output file");
+    }
+
+    uint64_t *mask = NULL;
+    if (opt.mask) {
+        mask = mask_build(&opt, &shape);
+        b.mask = mask;
+        if (opt.diff) b2.mask = mask;
+    }
+    if (opt.seed) fprintf(stderr, "seeded %zu cells from %s\n", seed_load(&b, opt.seed), opt.seed);
+    Snapshot snap;
+    if (opt.snapshot) {
+        snapshot_start(&snap, &opt);
+        b.snap = &snap;
+    }
+
+    pthread_t diff_tid;
+    if (opt.diff && pthread_create(&diff_tid, NULL, diff_ingest, &b2) != 0)
+        die("Failed to start --diff input thread");
+
+    if (ps.cached) {
+        /* -Rauto already parsed everything; bin from the cache. */
+        if (b.engine == ENGINE_AUTO) {
+            prescan_profile(&ps, &opt, &shape, &b.prof);
+            engine_from_profile(&b);
+        }
+        prescan_bin(&ps, &b);
+    } else if (opt.preview) {
+        preview_bin(&b);
+        fprintf(stderr, "preview: binned %llu of %llu bytes\n", b.sampled_bytes, b.input_bytes);
+    } else {
+        binner_stream(&b, opt.path);
+    }
+    binner_finish(&b);
+    if (opt.diff) pthread_join(diff_tid, NULL);
+    fprintf(stderr, "updated ar(x,y) with z%s\n", reducer_names[opt.reducer]);
+    if (opt.zfilter || opt.clip || opt.mask) {
+        fprintf(stderr, "filtered %llu of %llu points\n", b.cnt.filtered, b.cnt.points);
+        if (opt.diff)
+            fprintf(stderr, "filtered %llu of %llu points in %s\n", b2.cnt.filtered, b2.cnt.points, opt.diff);
+    }
+    if (opt.seed || opt.delta) {
+        size_t changed = 0;
+        for (size_t k = 0; k < b.nlayer; ++k)
+            if (b.layer[k])
+                for (size_t i = 0; i < b.layer[k]->g.ncell; ++i) changed += b.layer[k]->g.hit[i] == 1;
+        fprintf(stderr, "changed %zu cells\n", changed);
+    }
+    if (opt.ground) {
+        size_t kept = 0, cells = 0;
+        binner_ground(&b, &kept, &cells);
+        if (opt.diff) binner_ground(&b2, &kept, &cells);
+        fprintf(stderr, "ground: kept %zu of %zu cells (slope %g, window %g)\n",
+                kept, cells, opt.ground_slope, opt.ground_window);
+    }
+    if (opt.nmorph) {
+        binner_morph(&b);
+        if (opt.diff) binner_morph(&b2);
+        fprintf(stderr, "filtered grid%s with", opt.diff || b.nlayer > 1 ? "s" : "");
+        for (size_t s = 0; s < opt.nmorph; ++s)
+            fprintf(stderr, " %s %ux%u", morph_names[opt.morph[s].op], opt.morph[s].w, opt.morph[s].w);
+        fprintf(stderr, "\n");
+    }
+    if (opt.diff) {
+        DiffStats dst;
+        diff_grids(&b.layer[0]->g, &b2.layer[0]->g, &dst);
+        diff_report(&dst);
+        /* Print the difference numerically, not the first input's tokens. */
+        ztok_release(&b.layer[0]->g);
+    }
+    /* After the difference, so only cells both inputs occupy enter it and
+       its statistics; with --diff the difference grid is filled. */
+    if (opt.fill) {
+        size_t filled = 0, empty = 0;
+        binner_fill(&b, &filled, &empty);
+        if (opt.fill == FILL_NN) fprintf(stderr, "filled %zu of %zu empty cells (nn)\n", filled, empty);
+        else fprintf(stderr, "filled %zu of %zu empty cells (idw %g)\n", filled, empty, opt.fill_radius);
+    }
+    if (b.snap) {
+        snapshot_finish(b.snap, &b.layer[0]->g, b.cnt.points);
+        fprintf(stderr, "wrote %u snapshot%s to %s\n", snap.written, snap.written == 1 ? "" : "s", opt.snapshot);
+        b.snap = NULL;
+    }
+
+    /* Write results. Only print cells that received data. */
+    char note[160];
+    note[0] = '\0';
+    if (opt.preview)
+        snprintf(note, sizeof(note), "# approximate: preview of 1 in %u input chunks (%llu of %llu bytes)\n",
+                 opt.preview, b.sampled_bytes, b.input_bytes);
+    if (fout) {
+        fprintf(stderr, "write %s\n", opt.out);
+        fputs(note, fout);
+        if (b.qt) {
+            const size_t blocks = qt_write(&opt, b.qt, fout);
+            fprintf(stderr, "wrote %zu blocks; %zu nodes, %zu buckets of %u points (%.1f MiB)\n",
+                    blocks, b.qt->nnode - 1, b.qt->nbucket, opt.qt_split,
+                    ((double)b.qt->node_cap * sizeof(QNode) +
+                     (double)b.qt->bucket_cap * opt.qt_split * sizeof(QPoint)) / 1048576.0);
+        } else {
+            write_layers(&opt, b.layer, fout);
+        }
+        fclose(fout);
+    }
+    if (opt.group_col) write_groups(&opt, &b, note[0] ? note : NULL);
+    if (opt.tiles) write_tiles(&opt, &b.layer[0]->g);
+    if (opt.shm) {
+        Grid *g = &b.layer[0]->g;
+        grid_publish_shm(g);
+        fprintf(stderr, "published %zu x %zu grid in shared memory %s\n", g->nx, g->ny, opt.shm);
+    }
+    if (opt.grid_file) {
+        Grid *g = &b.layer[0]->g;
+        grid_flush_file(g);
+        fprintf(stderr, "wrote %zu x %zu grid to %s (%.1f MiB mapped)\n", g->nx, g->ny, opt.grid_file,
+                (double)g->map_len / 1048576.0);
+    }
+
+    if (opt.stats) {
+        print_stats(&b, opt.path);
+        if (opt.diff) print_stats(&b2, opt.diff);
+    }
+
+    prescan_free(&ps);
+    binner_free(&b);
+    if (opt.diff) binner_free(&b2);
+    for (size_t k = 0; k < opt.ngroup; ++k) free(opt.group_name[k]);
+    free(opt.group_lo);
+    free(opt.group_hi);
+    free(opt.group_name);
     free(opt.path);
     free(opt.out);
+    free(opt.snapshot);
+    free(opt.shm);
+    free(opt.grid_file);
+    free(opt.mask);
+    free(opt.diff);
+    free(opt.tiles);
+    free(opt.seed);
+    free(mask);
 
     return 0;
 }
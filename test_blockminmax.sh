@@ -6,6 +6,31 @@ set -euo pipefail
 #   1) Default (llround + clamp), with --tclfmt for stable text
 #   2) Tcl-like (--tclround --tclfmt)
 #   3) GMT-like (--gmtbin)
+#   4) Default mode with the region derived from the data (-Rauto+s)
+#   5) Engine agreement: on a dense, tie-heavy dataset every engine and
+#      kernel must reproduce the plain scalar in-place update (--tclfmt),
+#      for every --reducer
+#   6) Power-of-two increment (-I0.5) with points on exact half-cell ties,
+#      in all three modes (exercises the reciprocal snapping path)
+#   7) Each --reducer on a single cell with a different answer per reducer
+#   8) --tclfmt reproduces unusual z tokens exactly (packed and text forms)
+#   9) Ingest filters: -Z, --clip and --mask (polygon with a hole)
+#  10) --groupby by distinct value and by named ranges
+#  11) --zcols: several value columns reduced per cell, written as columns
+#  12) --diff: second input's minima minus the first's, where both have data
+#  13) --morph dilate: window maxima over filled cells, empty cells stay empty
+#  14) --ground: a spike on a gentle ramp is emptied, the ramp is kept
+#  15) --fill nn and idw: filled values and the filled-flag column
+#  16) --quadtree: a crowded block splits down to cells, a sparse one stays whole,
+#      edge blocks are clipped to -R
+#  17) --tiles: two-level pyramid, empty tiles skipped, merged cells, index
+#  18) --seed/--delta: a seeded rerun writes only the improved and new cells
+#  19) --grid-file: header, hit bytes and NaN for empty cells in the mapped file
+#  20) --read-once: same output as a plain read, also with -Rauto
+#  21) --shm: header and values; a rerun replaces the object without
+#      truncating the one a reader still has open
+#  22) --snapshot: the snapshot file appears, parses and ends as the final grid;
+#      a mid-run snapshot is the grid of the points it counts
 # - Compares against a reference answer after sorting rows.
 
 SCRIPT_DIR="$(cd "$(dirname "$0")" && pwd)"
@@ -33,7 +58,7 @@ REG="-R0/2/0/2"
 INC="-I1"
 INP="testdata_small.xyz"
 
-rm -f out_default.min out_tcllike.min out_gmt.min
+rm -f out_default.min out_tcllike.min out_gmt.min out_rauto.min
 
 # 1) Default mode (llround + clamp); use native formatting (no --tclfmt)
 "$BIN" $REG $INC -PATH "$INP" -o out_default.min >/dev/null
@@ -44,6 +69,9 @@ rm -f out_default.min out_tcllike.min out_gmt.min
 # 3) GMT-like binning (gridline registration); prints x,y as %.1f and z numeric
 "$BIN" $REG $INC -PATH "$INP" --gmtbin -o out_gmt.min >/dev/null
 
+# 4) Region from the data, snapped outward to -I: -1/2/-1/2, same nodes as default
+"$BIN" -Rauto+s $INC -PATH "$INP" --threads 2 -o out_rauto.min >/dev/null 2>&1
+
 # References per mode
 cat > ref_default.min << 'EOF'
 0 0 5
@@ -71,9 +99,236 @@ LC_ALL=C sort ref_gmt.min > ref_gmt.sorted
 LC_ALL=C sort out_default.min > out_default.sorted
 LC_ALL=C sort out_tcllike.min > out_tcllike.sorted
 LC_ALL=C sort out_gmt.min > out_gmt.sorted
+LC_ALL=C sort out_rauto.min > out_rauto.sorted
 
 diff -u ref_default.sorted out_default.sorted >/dev/null && echo "PASS default" || { echo "FAIL default"; diff -u ref_default.sorted out_default.sorted || true; exit 1; }
 diff -u ref_tcllike.sorted out_tcllike.sorted >/dev/null && echo "PASS tcllike" || { echo "FAIL tcllike"; diff -u ref_tcllike.sorted out_tcllike.sorted || true; exit 1; }
 diff -u ref_gmt.sorted out_gmt.sorted >/dev/null && echo "PASS gmtbin" || { echo "FAIL gmtbin"; diff -u ref_gmt.sorted out_gmt.sorted || true; exit 1; }
+diff -u ref_default.sorted out_rauto.sorted >/dev/null && echo "PASS rauto" || { echo "FAIL rauto"; diff -u ref_default.sorted out_rauto.sorted || true; exit 1; }
+
+# 5) Engines must agree, including which of several equal z tokens wins
+awk 'BEGIN { srand(5); split("%d %.1f %.2f %de0", f, " ");
+  for (i = 0; i < 20000; ++i) printf "%.2f %.2f " f[1 + int(rand() * 4)] "\n", rand() * 4, rand() * 4, int(rand() * 6) }' > testdata_ties.xyz
+for mm in "" "-MAX" "--reducer first" "--reducer last" "--reducer sum" "--reducer nearest" "--reducer mode"; do
+  "$BIN" -R0/4/0/4 $INC -PATH testdata_ties.xyz --tclfmt $mm --engine dense --prefetch 0 --no-simd --no-runs -o out_ties_ref.min >/dev/null 2>&1
+  for eng in "--engine dense" "--engine dense --prefetch 4 --no-runs" "--engine dense --prefetch 4 --no-simd" "--engine sort" "--engine sort --no-runs"; do
+    "$BIN" -R0/4/0/4 $INC -PATH testdata_ties.xyz --tclfmt $mm $eng -o out_ties.min >/dev/null 2>&1
+    cmp -s out_ties_ref.min out_ties.min || { echo "FAIL engines ($eng $mm)"; diff -u out_ties_ref.min out_ties.min | head -20 || true; exit 1; }
+  done
+done
+echo "PASS engines"
+
+# 6) -I0.5: 0.25/0.75/1.25/1.75 sit exactly between nodes. Default rounds
+#    half away from zero, Tcl-like prefers the lower node, GMT rounds to even.
+cat > testdata_half.xyz << 'EOF'
+0.25 0.75 1
+1.25 1.75 2
+0.74 0.26 3
+EOF
+printf '0.5 0.5 3\n0.5 1 1\n1.5 2 2\n' > ref_half_default.min
+printf '0.0 0.5 1\n0.5 0.5 3\n1.0 1.5 2\n' > ref_half_tcllike.min
+printf '0.0 1.0 1\n0.5 0.5 3\n1.0 2.0 2\n' > ref_half_gmt.min
+"$BIN" $REG -I0.5 -PATH testdata_half.xyz -o out_half_default.min >/dev/null
+"$BIN" $REG -I0.5 -PATH testdata_half.xyz --tclround --tclfmt -o out_half_tcllike.min >/dev/null
+"$BIN" $REG -I0.5 -PATH testdata_half.xyz --gmtbin -o out_half_gmt.min >/dev/null
+for m in default tcllike gmt; do
+  LC_ALL=C sort out_half_$m.min | diff -u ref_half_$m.min - >/dev/null || { echo "FAIL pow2 inc ($m)"; LC_ALL=C sort out_half_$m.min | diff -u ref_half_$m.min - || true; exit 1; }
+done
+echo "PASS pow2 inc"
+
+# 7) Reducers: one cell, a different answer for each statistic
+cat > testdata_reduce.xyz << 'EOF'
+0.1 0.1 3
+0.4 0.4 7
+-0.2 0.0 -1
+0.0 0.05 5
+0.3 0.2 4
+0.3 0.1 4
+0.2 0.3 2
+EOF
+for rv in min:-1 max:7 first:3 last:2 sum:24 nearest:5 mode:4; do
+  "$BIN" $REG $INC -PATH testdata_reduce.xyz --reducer "${rv%%:*}" -o out_reduce.min >/dev/null 2>&1
+  [[ "$(cat out_reduce.min)" == "0 0 ${rv#*:}" ]] || { echo "FAIL reducers (${rv%%:*}: $(cat out_reduce.min))"; exit 1; }
+done
+echo "PASS reducers"
+
+# 8) Tokens: leading zeros, signs, exponent forms, long significands, hex, inf/nan
+toks=(007.50 +3 1E+05 2.50e-003 -0 .5 5. 12345678901234567890.5 0x1p3 -inf nan 5e)
+: > testdata_tokens.xyz
+: > ref_tokens.min
+for k in "${!toks[@]}"; do
+  echo "$k 0 ${toks[$k]}" >> testdata_tokens.xyz
+  [[ "${toks[$k]}" == 5e ]] && t=5 || t="${toks[$k]}"
+  printf '%d.0 0.0 %s\n' "$k" "$t" >> ref_tokens.min
+done
+"$BIN" -R0/11/0/1 $INC -PATH testdata_tokens.xyz --tclround --tclfmt -o out_tokens.min >/dev/null 2>&1
+cmp -s ref_tokens.min out_tokens.min && echo "PASS tokens" || { echo "FAIL tokens"; diff -u ref_tokens.min out_tokens.min || true; exit 1; }
+
+# 9) Filters: one point per node of a 5x5 grid, z = x + y
+: > testdata_filter.xyz
+for x in 0 1 2 3 4; do for y in 0 1 2 3 4; do echo "$x $y $((x + y))" >> testdata_filter.xyz; done; done
+printf '> outer\n0 0\n4 0\n4 4\n0 4\n> hole\n1 1\n3 1\n3 3\n1 3\n' > testdata_filter.gmt
+check_filter() {
+  local want=$1; shift
+  "$BIN" -R0/4/0/4 $INC -PATH testdata_filter.xyz "$@" -o out_filter.min >/dev/null 2>&1
+  local got; got=$(LC_ALL=C sort -n -k1,1 -k2,2 out_filter.min | awk '{printf "%s,%s ", $1, $2}')
+  [[ "$got" == "$want" ]] || { echo "FAIL filters ($*: $got)"; exit 1; }
+}
+check_filter "0,3 0,4 1,2 1,3 2,1 2,2 3,0 3,1 4,0 " -Z3/4
+check_filter "3,3 3,4 4,3 4,4 " --clip 2.5/9/2.5/9
+check_filter "0,0 0,1 0,2 0,3 1,0 1,3 2,0 2,3 3,0 3,1 3,2 3,3 " --mask testdata_filter.gmt
+echo "PASS filters"
+
+# 10) Group-by: column 4 is a class code; each group has its own minima
+cat > testdata_group.xyz << 'EOF'
+0 0 5 2
+0 0 3 6
+0 0 4 2
+1 1 9 6
+1 1 8 6
+2 2 7 3
+EOF
+rm -f out_group.min.*
+"$BIN" $REG $INC -PATH testdata_group.xyz --groupby 4 -o out_group.min >/dev/null 2>&1
+[[ "$(cat out_group.min.2)" == "0 0 4" && "$(cat out_group.min.3)" == "2 2 7" &&
+   "$(LC_ALL=C sort out_group.min.6 | tr '\n' ,)" == "0 0 3,1 1 8," ]] || { echo "FAIL groupby (values)"; exit 1; }
+"$BIN" $REG $INC -PATH testdata_group.xyz --groupby 4:ground=2,3/5 -o out_group.min >/dev/null 2>&1
+[[ "$(cat out_group.min.ground)" == "0 0 4" && "$(cat out_group.min.3-5)" == "2 2 7" ]] || { echo "FAIL groupby (ranges)"; exit 1; }
+echo "PASS groupby"
+
+# 11) Value columns: max of intensity (5) and z (3) per cell, z token kept
+cat > testdata_bands.xyz << 'EOF'
+0 0 1.50 7 120
+0 0 2.5 7 90
+1 1 -3 7 40
+EOF
+"$BIN" $REG $INC -PATH testdata_bands.xyz --reducer max --zcols 5,3 --tclfmt -o out_bands.max >/dev/null 2>&1
+[[ "$(LC_ALL=C sort out_bands.max | tr '\n' ,)" == "0.0 0.0 120 2.5,1.0 1.0 40 -3," ]] || { echo "FAIL bands ($(tr '\n' , < out_bands.max))"; exit 1; }
+echo "PASS bands"
+
+# 12) Difference: cells (0,0) and (1,1) are in both inputs, (2,2) only in the first
+printf '0 0 5\n0 0 4\n1 1 2\n2 2 9\n' > testdata_diff_a.xyz
+printf '0 0 6.5\n1 1 1\n1 1 3\n' > testdata_diff_b.xyz
+"$BIN" $REG $INC -PATH testdata_diff_a.xyz --diff testdata_diff_b.xyz -o out_diff.min 2> out_diff.log >/dev/null
+[[ "$(LC_ALL=C sort out_diff.min | tr '\n' ,)" == "0 0 2.5,1 1 -1," ]] || { echo "FAIL diff ($(tr '\n' , < out_diff.min))"; exit 1; }
+grep -q 'mean 0.75, std 1.75' out_diff.log || { echo "FAIL diff (statistics)"; cat out_diff.log; exit 1; }
+echo "PASS diff"
+
+# 13) Morphology: each filled cell takes the max of its 3x3 neighbourhood
+printf '0 0 5\n1 0 3\n2 0 8\n1 1 1\n2 2 9\n' > testdata_morph.xyz
+"$BIN" $REG $INC -PATH testdata_morph.xyz --morph dilate:3 -o out_morph.min >/dev/null 2>&1
+[[ "$(LC_ALL=C sort out_morph.min | tr '\n' ,)" == "0 0 5,1 0 8,1 1 9,2 0 8,2 2 9," ]] || { echo "FAIL morph ($(tr '\n' , < out_morph.min))"; exit 1; }
+echo "PASS morph"
+
+# 14) Ground filter: 7x7 ramp rising 0.1 per cell in x, with a 5 m spike at (3,3)
+for y in 0 1 2 3 4 5 6; do for x in 0 1 2 3 4 5 6; do
+  echo "$x $y $(( x == 3 && y == 3 ? 5 : 0 )).$x"
+done; done > testdata_ground.xyz
+"$BIN" -R0/6/0/6 $INC -PATH testdata_ground.xyz --ground 0.5/2 -o out_ground.min >/dev/null 2>&1
+[[ "$(wc -l < out_ground.min)" -eq 48 ]] && ! grep -q '^3 3 ' out_ground.min &&
+  grep -q '^6 6 0.6$' out_ground.min || { echo "FAIL ground"; exit 1; }
+echo "PASS ground"
+
+# 15) Gap filling on a 5x2 grid with two occupied cells, then of a difference
+printf '0 0 1.5\n4 0 7\n' > testdata_fill.xyz
+"$BIN" -R0/4/0/1 $INC -PATH testdata_fill.xyz --fill nn -o out_fill.min >/dev/null 2>&1
+[[ "$(tr '\n' , < out_fill.min)" == "0 0 1.5 0,1 0 1.5 1,2 0 1.5 1,3 0 7 1,4 0 7 0,0 1 1.5 1,1 1 1.5 1,2 1 1.5 1,3 1 7 1,4 1 7 1," ]] ||
+  { echo "FAIL fill nn ($(tr '\n' , < out_fill.min))"; exit 1; }
+"$BIN" -R0/4/0/1 $INC -PATH testdata_fill.xyz --fill idw:3 -o out_fill.min >/dev/null 2>&1
+[[ "$(tr '\n' , < out_fill.min)" == "0 0 1.5 0,1 0 2.05 1,2 0 4.25 1,3 0 6.45 1,4 0 7 0,0 1 1.5 1,1 1 1.5 1,2 1 4.25 1,3 1 7 1,4 1 7 1," ]] ||
+  { echo "FAIL fill idw ($(tr '\n' , < out_fill.min))"; exit 1; }
+# with --diff only (0,0) and (2,0) are in both inputs; the fill comes after
+printf '0 0 1\n2 0 5\n' > testdata_fill_a.xyz
+printf '0 0 2\n1 0 3\n2 0 9\n' > testdata_fill_b.xyz
+"$BIN" -R0/2/0/1 $INC -PATH testdata_fill_a.xyz --diff testdata_fill_b.xyz --fill nn -o out_fill.diff 2> out_fill.log >/dev/null
+grep -q 'diff: 2 cells in both inputs' out_fill.log && grep -q 'mean 2.5, std 1.5' out_fill.log &&
+  [[ "$(grep -c ' 0$' out_fill.diff)" -eq 2 && "$(wc -l < out_fill.diff)" -eq 6 ]] || { echo "FAIL fill diff"; exit 1; }
+echo "PASS fill"
+
+# 16) Quadtree of one 4x4 root block, split above 2 points: its lower-left
+#     quarter holds three points and splits again; the upper-right has one.
+#     On a 5x5 grid the right and top root blocks are clipped to one column
+#     and one row: a 1x4 block centred at x=4, and a 1x1 block at (4, 4)
+printf '0 0 5\n0 0 4\n1 1 3\n3 3 7\n' > testdata_quadtree.xyz
+"$BIN" -R0/3/0/3 $INC -PATH testdata_quadtree.xyz --quadtree 2:2 -o out_quadtree.min >/dev/null 2>&1
+[[ "$(tr '\n' , < out_quadtree.min)" == "0 0 4 1 1,1 1 3 1 1,2.5 2.5 7 2 2," ]] ||
+  { echo "FAIL quadtree ($(tr '\n' , < out_quadtree.min))"; exit 1; }
+printf '4 0 2\n4 4 6\n' >> testdata_quadtree.xyz
+"$BIN" -R0/4/0/4 $INC -PATH testdata_quadtree.xyz --quadtree 2:2 -o out_quadtree.min >/dev/null 2>&1
+[[ "$(tr '\n' , < out_quadtree.min)" == "0 0 4 1 1,1 1 3 1 1,2.5 2.5 7 2 2,4 1.5 2 1 4,4 4 6 1 1," ]] ||
+  { echo "FAIL quadtree edge ($(tr '\n' , < out_quadtree.min))"; exit 1; }
+echo "PASS quadtree"
+
+# 17) Tiles of 2x2 cells on a 4x4 grid, two levels: at z=1 only the tiles
+#     holding (0,0)-(1,0) and (3,3) exist; z=0 is one tile of merged minima
+printf '0 0 5\n3 3 7\n1 0 2\n' > testdata_tiles.xyz
+rm -rf out_tiles
+"$BIN" -R0/3/0/3 $INC -PATH testdata_tiles.xyz --tiles out_tiles --tile-size 2 --tile-levels 2 >/dev/null 2>&1
+[[ "$(tr '\n' , < out_tiles/1/0/1.txt)" == "0 0 5,1 0 2," && "$(cat out_tiles/1/1/0.txt)" == "3 3 7" &&
+   ! -e out_tiles/1/0/0.txt && ! -e out_tiles/1/1/1.txt &&
+   "$(tr '\n' , < out_tiles/0/0/0.txt)" == "0.5 0.5 2,2.5 2.5 7," &&
+   "$(grep -c '"z"' out_tiles/index.json)" -eq 3 ]] || { echo "FAIL tiles"; exit 1; }
+echo "PASS tiles"
+
+# 18) Seed with the tiles test output, then add a lower (0,0), a higher
+#     (1,0) and a new (2,2): the delta holds the improved and the new cell
+printf '0 0 1\n1 0 9\n2 2 4\n' > testdata_delta.xyz
+"$BIN" -R0/3/0/3 $INC -PATH testdata_tiles.xyz -o out_delta.seed >/dev/null 2>&1
+"$BIN" -R0/3/0/3 $INC -PATH testdata_delta.xyz --seed out_delta.seed --delta -o out_delta.min >/dev/null 2>&1
+[[ "$(tr '\n' , < out_delta.min)" == "0 0 1,2 2 4," ]] || { echo "FAIL delta"; exit 1; }
+echo "PASS delta"
+
+# 19) --grid-file: header (version 2, ready, hit_offset, SHM_EMPTY_BY_HIT), hit bytes
+#     and NaN for empty cells next to data
+rm -f out_grid.bin
+"$BIN" -R0/3/0/3 $INC -PATH testdata_tiles.xyz --grid-file out_grid.bin >/dev/null 2>&1
+[[ "$(head -c 7 out_grid.bin)" == "BMMGRID" && "$(od -An -t u4 -j 8 -N 4 out_grid.bin | xargs)" == "2" &&
+   "$(od -An -t u8 -j 96 -N 24 out_grid.bin | xargs)" == "1 8192 1" &&
+   "$(od -An -t u1 -j 8192 -N 16 out_grid.bin | xargs)" == "1 1 0 0 0 0 0 0 0 0 0 0 0 0 0 1" &&
+   "$(od -An -t f8 -j 4096 -N 24 out_grid.bin | xargs)" == "5 2 nan" ]] || { echo "FAIL grid-file"; exit 1; }
+echo "PASS grid-file"
+
+# 20) --read-once only changes page-cache hints: same output, also with -Rauto
+"$BIN" $REG $INC -PATH "$INP" --read-once -o out_readonce.min >/dev/null 2>&1
+"$BIN" -Rauto+s $INC -PATH "$INP" --read-once -o out_readonce.rauto >/dev/null 2>&1
+cmp -s out_readonce.min ref_default.min && cmp -s out_readonce.rauto out_rauto.min || { echo "FAIL read-once"; exit 1; }
+echo "PASS read-once"
+
+# 21) --shm: the object holds the header and values; a second run replaces
+#     it without truncating the one a reader still has open (Linux /dev/shm)
+if [[ -d /dev/shm ]]; then
+  SHM=blockminmax_test_$$
+  "$BIN" -R0/3/0/3 $INC -PATH testdata_tiles.xyz --shm $SHM >/dev/null 2>&1
+  exec 3< /dev/shm/$SHM
+  "$BIN" -R0/3/0/3 $INC -PATH testdata_delta.xyz --shm $SHM >/dev/null 2>&1
+  old="$(od -An -t f8 -j 4096 -N 24 <&3 | xargs)"
+  exec 3<&-
+  new="$(od -An -t f8 -j 4096 -N 24 /dev/shm/$SHM | xargs)"
+  ready="$(head -c 7 /dev/shm/$SHM)$(od -An -t u8 -j 96 -N 8 /dev/shm/$SHM | xargs)"
+  rm -f /dev/shm/$SHM
+  [[ "$old" == "5 2 nan" && "$new" == "1 9 nan" && "$ready" == "BMMGRID1" ]] || { echo "FAIL shm ($old / $new / $ready)"; exit 1; }
+fi
+echo "PASS shm"
+
+# 22) --snapshot: the file appears with its header line and, after the last
+#     snapshot, holds the final grid (sort engine: buffered records applied)
+rm -f out_snapshot.min
+"$BIN" $REG $INC -PATH "$INP" --engine sort --snapshot out_snapshot.min --snapshot-every 0.001 -o out_snapshot.out >/dev/null 2>&1
+[[ "$(head -1 out_snapshot.min)" =~ ^"# snapshot "[0-9]+" after "[0-9]+" points"$ ]] &&
+  tail -n +2 out_snapshot.min | cmp -s - ref_default.min || { echo "FAIL snapshot"; exit 1; }
+# A snapshot taken mid-run is the grid of its first P points: the input
+# pauses after 131072 lines (two 64K-point checks) while the file is read.
+awk 'BEGIN { for (i = 0; i < 200000; ++i) printf "%d %d %d\n", i % 50, int(i / 50) % 50, (i * 7919) % 1000 }' > testdata_snapshot.xyz
+rm -f out_snapshot.mid
+{ head -n 131072 testdata_snapshot.xyz; sleep 1; tail -n +131073 testdata_snapshot.xyz; } |
+  "$BIN" -R0/49/0/49 $INC -PATH /dev/stdin --engine sort --snapshot out_snapshot.mid --snapshot-every 0.001 -o out_snapshot.out >/dev/null 2>&1 &
+sleep 0.5
+cp out_snapshot.mid out_snapshot.part 2>/dev/null
+wait
+P=$(head -1 out_snapshot.part 2>/dev/null | awk '{ print $5 }')
+[[ -n "$P" ]] && head -n "$P" testdata_snapshot.xyz |
+  "$BIN" -R0/49/0/49 $INC -PATH /dev/stdin -o out_snapshot.ref >/dev/null 2>&1 &&
+  tail -n +2 out_snapshot.part | cmp -s - out_snapshot.ref || { echo "FAIL snapshot mid-run"; exit 1; }
+echo "PASS snapshot"
 
 echo "All tests passed"